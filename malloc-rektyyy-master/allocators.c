@@ -0,0 +1,33 @@
+/*
+ * allocators.c - the allocator registry. mm.c (the segregated-list
+ * allocator with the treap for large blocks) keeps its usual exported
+ * names and is the default; the others register themselves through
+ * records of their own.
+ */
+
+#include "allocators.h"
+#include "mm.h"
+
+static const allocator_t seglist = {
+  .name = "seglist",
+  .init = mm_init,
+  .malloc = mm_malloc,
+  .free = mm_free,
+  .realloc = mm_realloc,
+  .calloc = mm_calloc,
+  .memalign = mm_aligned_alloc,
+  .malloc_batch = mm_malloc_batch,
+  .free_batch = mm_free_batch,
+  .checkheap = mm_checkheap,
+  .stats = mm_stats,
+  .trace_start = mm_trace_start,
+  .trace_dump = mm_trace_dump,
+};
+
+extern const allocator_t allocator_implicit; /* mm-implicit.c */
+
+const allocator_t *const allocators[] = {
+  &seglist,
+  &allocator_implicit,
+  NULL,
+};
@@ -0,0 +1,29 @@
+/*
+ * allocators.h - registry of allocator implementations the driver can
+ * select at runtime (-A <name>). Each implementation exports exactly one
+ * allocator_t record; its entry points stay static inside its own
+ * translation unit, so several allocators link into one binary.
+ */
+
+#include <stddef.h>
+
+struct mm_stats_out;
+
+typedef struct {
+  const char *name;
+  int (*init)(void);
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void *(*calloc)(size_t nmemb, size_t size);
+  void *(*memalign)(size_t alignment, size_t size); /* optional, may be NULL */
+  size_t (*malloc_batch)(size_t size, size_t n, void **out); /* optional */
+  void (*free_batch)(void **ptrs, size_t n);                 /* optional */
+  void (*checkheap)(int verbose);
+  void (*stats)(struct mm_stats_out *out); /* optional, may be NULL */
+  int (*trace_start)(size_t records);      /* optional event tracing */
+  void (*trace_dump)(int fd);              /* optional, pairs with it */
+} allocator_t;
+
+/* NULL-terminated; the first entry is the default. */
+extern const allocator_t *const allocators[];
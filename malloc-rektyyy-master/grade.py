@@ -1,17 +1,31 @@
 #!/usr/bin/env python3
 
+import json
 import math
+import os
 import signal
 import subprocess
 import sys
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_aligned_alloc', 'mm_calloc', 'mm_checkheap', 'mm_free',
+                   'mm_free_batch', 'mm_init', 'mm_malloc', 'mm_malloc_batch',
+                   'mm_posix_memalign', 'mm_realloc', 'mm_stats',
+                   'mm_trace_dump', 'mm_trace_start', 'mm_trim']
 
 
 MINUTIL = 60
 TIMEOUT = 30
+
+# Regression gate: per-trace results land in RESULTS_FILE after every run;
+# BASELINE_FILE is the committed reference (refresh it with
+# ./grade.py --update-baseline after an intentional change). A trace fails
+# the gate when its instruction count per op or peak heap size grows, or
+# its utilization drops, by more than THRESHOLD percent relative to the
+# baseline (override with --threshold <pct>).
+RESULTS_FILE = 'grade.json'
+BASELINE_FILE = 'grade-baseline.json'
+THRESHOLD = 10.0
 TRACEFILES = [
         "traces/amptjp-bal.rep",
         "traces/amptjp.rep",
@@ -84,7 +98,7 @@ def runtrace(trace):
         "--toggle-collect=mm_free",
         "--toggle-collect=mm_realloc",
         "--toggle-collect=mm_calloc",
-        "--", "./mdriver", "-f", trace],
+        "--", "./mdriver", "-f", trace, "-J", "grade-trace.json"],
         capture_output=True, timeout=TIMEOUT)
 
     output = mdriver.stdout.decode()
@@ -101,14 +115,15 @@ def runtrace(trace):
         raise SystemExit(f"Your solution has exited abnormally "
                          f"with status {mdriver.returncode}!")
 
-    # Process statistics from mdriver
-    stats = mdriver.stdout.decode().splitlines()[3][4:].split()
+    # Process statistics from mdriver (-J per-trace JSON)
     try:
-        util = float(stats[1][:-1])
-        used = int(stats[2])
-        total = int(stats[3])
-    except ValueError:
-        print(stats)
+        with open("grade-trace.json") as f:
+            stats = json.load(f)[0]
+        util = 100.0 * stats['util']
+        used = stats['used']
+        total = stats['total']
+        os.unlink("grade-trace.json")
+    except (OSError, ValueError, IndexError, KeyError):
         raise SystemExit("Reading statistics from 'mdriver' has failed :( "
                          "This is a bug - please report it!")
 
@@ -160,7 +175,48 @@ def check_sections():
         raise SystemExit("Your solution was disqualified! :(")
 
 
+def check_baseline(results, threshold):
+    if not os.path.exists(BASELINE_FILE):
+        print("\nNo baseline (%s) - regression gate skipped." % BASELINE_FILE)
+        print("Record one with './grade.py --update-baseline'.")
+        return
+
+    with open(BASELINE_FILE) as f:
+        baseline = json.load(f)['traces']
+
+    regressions = []
+    for trace, new in results.items():
+        old = baseline.get(trace)
+        if old is None:
+            continue
+        # sign +1: growth is bad (insn/op, heap); -1: shrinkage is bad (util)
+        for metric, sign in [('insn_per_op', 1), ('total', 1), ('util', -1)]:
+            was, now = old[metric], new[metric]
+            if was <= 0:
+                continue
+            change = sign * 100.0 * (now - was) / was
+            if change > threshold:
+                regressions.append(
+                    "%s: %s regressed %s -> %s (%+.1f%%)"
+                    % (trace, metric, was, now, sign * change))
+
+    if regressions:
+        print("\nPerformance regressions beyond %.0f%% "
+              "against '%s':" % (threshold, BASELINE_FILE))
+        for line in regressions:
+            print("  " + line)
+        raise SystemExit("Your solution has performance regressions! :(")
+
+    print("\nNo regressions beyond %.0f%% against '%s'."
+          % (threshold, BASELINE_FILE))
+
+
 if __name__ == '__main__':
+    update_baseline = '--update-baseline' in sys.argv
+    threshold = THRESHOLD
+    if '--threshold' in sys.argv:
+        threshold = float(sys.argv[sys.argv.index('--threshold') + 1])
+
     check_symbols()
     check_sections()
 
@@ -169,6 +225,7 @@ if __name__ == '__main__':
     all_util = []
     all_used = []
     all_total = []
+    all_results = {}
 
     for trace in TRACEFILES:
         print("\nRunning mdriver for '%s'..." % trace)
@@ -180,10 +237,17 @@ if __name__ == '__main__':
 
         util = 0.0              # default utilization penalty for timeout
         insn = 50000.0 * ops    # default throughput penalty for timeout
+        used, total = 0, 0
         heapsz = math.inf
 
         try:
             util, insn, used, total = runtrace(trace)
+            all_results[trace] = {
+                'util': round(util, 1),
+                'insn_per_op': round(insn / ops, 1),
+                'used': used,
+                'total': total,
+            }
         except subprocess.TimeoutExpired:
             print("Penalty accrued for timeout of %ds." % TIMEOUT)
 
@@ -204,6 +268,27 @@ if __name__ == '__main__':
     print("Total memory utilization: %.2f%%" % (100.0 * total_util))
     print("Instructions per operation: %d" % (sum(all_insn) / sum(all_ops)))
 
+    report = {
+        'traces': all_results,
+        'summary': {
+            'weighted_util': round(weighted_util, 1),
+            'total_util': round(100.0 * total_util, 2),
+            'insn_per_op': int(sum(all_insn) / sum(all_ops)),
+        },
+    }
+    with open(RESULTS_FILE, 'w') as f:
+        json.dump(report, f, indent=2)
+        f.write('\n')
+    print("Per-trace results written to '%s'." % RESULTS_FILE)
+
+    if update_baseline:
+        with open(BASELINE_FILE, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+        print("Baseline written to '%s' - commit it." % BASELINE_FILE)
+    else:
+        check_baseline(all_results, threshold)
+
     if weighted_util < MINUTIL:
         print("Minimum threshold for memory utilization "
               "of %d%% has not been met!" % MINUTIL)
@@ -11,7 +11,11 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -20,9 +24,13 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 
 #include "memlib.h"
+#include "allocators.h"
 #include "mm.h"
 
 /**********************
@@ -64,11 +72,31 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
+  enum { ALLOC, FREE, REALLOC, MEMALIGN, BALLOC, BFREE } type;
+  int index;    /* index for free() to use later; for batch ops the
+                 * first of count consecutive indices */
+  size_t size;  /* byte size of alloc/realloc request */
+  size_t align; /* "m" ops: requested alignment; "b"/"d" ops: the batch
+                 * count; else 0 */
 } traceop_t;
 
+/* Compiled binary trace: this header followed by a flat array of
+ * num_ops raw traceop_t records, produced with -c and mmapped back by
+ * read_trace. The records are the in-memory representation, so the
+ * format is specific to the host ABI — fine for an internal cache of
+ * large captured traces, not an interchange format. */
+#define REPB_MAGIC 0x42504552 /* "REPB", little-endian */
+#define REPB_VERSION 2        /* v2: traceop_t grew the align field */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t weight;
+  int32_t num_ids;
+  int32_t num_ops;
+  int32_t ignore_ranges;
+} repb_header_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
   char filename[MAXLINE];
@@ -77,6 +105,8 @@ typedef struct {
   int num_ops;          /* number of distinct requests */
   int weight;           /* weight for this trace (unused) */
   traceop_t *ops;       /* array of requests */
+  void *map;            /* mmapped binary trace backing ops (NULL: heap) */
+  size_t map_len;       /* length of the mapping */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
@@ -108,6 +138,8 @@ typedef struct {
   int used;    /* maximum bytes used by allocated blocks */
   int total;   /* total heap size */
 
+  long pagefaults; /* minor+major faults taken while replaying the trace */
+
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
@@ -130,7 +162,12 @@ static randint_t random_data[RANDOM_DATA_LEN];
 
 static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
-static int verbose = 1; /* global flag for verbose output */
+static int verbose = 1;    /* global flag for verbose output */
+static int mt_threads = 0; /* replay threads for -t (0 = off) */
+static const allocator_t *impl; /* allocator under test, from -A */
+static int bench_reps = 0;   /* timed repetitions for -b (0 = off) */
+static int bench_warmup = 3; /* untimed warmup repetitions for -w */
+static char *json_out = NULL; /* write per-trace results as JSON (-J) */
 
 /*********************
  * Function prototypes
@@ -149,6 +186,7 @@ static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *filename);
+static void write_trace_bin(const trace_t *trace, const char *outfile);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -161,9 +199,13 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_speed_mt(trace_t *trace, int nthreads);
 
 /* Various helper routines */
+static void printheader(void);
+static void printresults_row(stats_t *stats);
 static void printresults(stats_t *stats);
+static void write_results_json(const char *path, stats_t *stats, int n);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
@@ -178,6 +220,33 @@ static void app_error(const char *fmt, ...)
 
 typedef void (*fsecs_test_funct)(void *);
 
+/*
+ * print_mm_stats - Dump the allocator's internal counters (see mm_stats
+ * in mm.h) after a trace has been replayed.
+ */
+static void print_mm_stats(void) {
+  struct mm_stats_out st;
+  if (impl->stats == NULL) /* not every registered allocator keeps them */
+    return;
+  impl->stats(&st);
+
+  printf("\nAllocator stats:\n");
+  printf("  calls: %lu malloc, %lu free, %lu realloc\n",
+         (unsigned long)st.malloc_calls, (unsigned long)st.free_calls,
+         (unsigned long)st.realloc_calls);
+  printf("  bytes in use: %lu, coalesce merges: %lu\n",
+         (unsigned long)st.bytes_in_use, (unsigned long)st.coalesce_merges);
+  printf("  find_fit scan lengths:");
+  for (int i = 0; i < MM_FIT_HIST; i++)
+    printf(" [%s%d] %lu", i == MM_FIT_HIST - 1 ? ">=" : "",
+           i ? 1 << (i - 1) : 0, (unsigned long)st.fit_scan_hist[i]);
+  printf("\n  free blocks per class:");
+  for (int i = 0; i < MM_NUM_CLASSES; i++)
+    if (st.free_blocks[i])
+      printf(" [%d] %lu", i, (unsigned long)st.free_blocks[i]);
+  printf("\n");
+}
+
 /*
  * fsecs - Return the running time of a function f (in seconds)
  */
@@ -192,6 +261,62 @@ static double fsecs(fsecs_test_funct f, void *argp) {
   return (1E-3 * diff);
 }
 
+/*****************************************************************
+ * Benchmark harness (-b N). A single gettimeofday'd run is too noisy
+ * for A/B comparisons, so -b times N repetitions of the same replay
+ * with CLOCK_MONOTONIC_RAW (immune to NTP slew), after a few untimed
+ * warmup runs to fault in pages and warm the caches, and reports
+ * min/median/mean/stddev. The regular results table (what grade.py
+ * parses) is not touched.
+ ****************************************************************/
+
+static double now_monotonic(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+static int dbl_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_mm_speed(fsecs_test_funct f, void *argp, double nops) {
+  double *samples = (double *)malloc(bench_reps * sizeof(double));
+  if (samples == NULL)
+    unix_error("malloc error in bench_mm_speed");
+
+  for (int i = 0; i < bench_warmup; i++)
+    f(argp);
+  for (int i = 0; i < bench_reps; i++) {
+    double t0 = now_monotonic();
+    f(argp);
+    samples[i] = now_monotonic() - t0;
+  }
+  qsort(samples, bench_reps, sizeof(double), dbl_cmp);
+
+  double min = samples[0];
+  double median = (bench_reps % 2)
+                    ? samples[bench_reps / 2]
+                    : (samples[bench_reps / 2 - 1] + samples[bench_reps / 2]) / 2;
+  double mean = 0, var = 0;
+  for (int i = 0; i < bench_reps; i++)
+    mean += samples[i];
+  mean /= bench_reps;
+  for (int i = 0; i < bench_reps; i++)
+    var += (samples[i] - mean) * (samples[i] - mean);
+  double stddev = bench_reps > 1 ? sqrt(var / (bench_reps - 1)) : 0;
+
+  printf("\nBenchmark (%d reps, %d warmup, CLOCK_MONOTONIC_RAW):\n",
+         bench_reps, bench_warmup);
+  printf("  min    %.6f secs (%7.0f Kops)\n", min, nops / (1E3 * min));
+  printf("  median %.6f secs (%7.0f Kops)\n", median, nops / (1E3 * median));
+  printf("  mean   %.6f secs +- %.6f (%.1f%%)\n", mean, stddev,
+         mean > 0 ? 100 * stddev / mean : 0);
+
+  free(samples);
+}
+
 /* Run the tests; return the number of tests run (may be less than
    num_tracefiles, if there's a timeout) */
 static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
@@ -204,6 +329,10 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   trace = read_trace(mm_stats, tracefile);
   strcpy(mm_stats->filename, trace->filename);
   mm_stats->ops = trace->num_ops;
+  /* Count the page faults the replay itself takes (not trace parsing),
+   * so the -H huge-page mode has something to compare against. */
+  struct rusage ru_start, ru_end;
+  getrusage(RUSAGE_SELF, &ru_start);
   if (verbose > 1)
     printf("Checking mm_malloc for correctness, ");
   mm_stats->valid = eval_mm_valid(trace, &ranges);
@@ -217,7 +346,16 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
     if (verbose > 1)
       printf("and performance.\n");
     mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    if (bench_reps > 0)
+      bench_mm_speed(eval_mm_speed, speed_params, mm_stats->ops);
+    if (mt_threads > 1)
+      eval_mm_speed_mt(trace, mt_threads);
+    if (verbose > 1)
+      print_mm_stats();
   }
+  getrusage(RUSAGE_SELF, &ru_end);
+  mm_stats->pagefaults = (ru_end.ru_minflt - ru_start.ru_minflt) +
+                         (ru_end.ru_majflt - ru_start.ru_majflt);
 
   free_trace(trace);
 
@@ -225,6 +363,91 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   mem_deinit();
 }
 
+/*****************************************************************
+ * Parallel evaluation. With several trace files on the command line
+ * the driver forks one child per trace, at most -j workers at a time
+ * (default: online cores). Each child runs the usual run_tests against
+ * its own copy of the address space, ships its stats_t back through a
+ * pipe, and the parent prints the merged table once everything exits.
+ ****************************************************************/
+
+static int eval_traces_parallel(char **tracefiles, int ntraces, int jobs) {
+  stats_t *stats = (stats_t *)calloc(ntraces, sizeof(stats_t));
+  int *fds = (int *)malloc(ntraces * sizeof(int));
+  if (stats == NULL || fds == NULL)
+    unix_error("malloc error in eval_traces_parallel");
+  if (jobs <= 0)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > ntraces)
+    jobs = ntraces;
+
+  int next = 0, running = 0;
+  while (next < ntraces || running > 0) {
+    while (running < jobs && next < ntraces) {
+      int pipefd[2];
+      if (pipe(pipefd) < 0)
+        unix_error("pipe error in eval_traces_parallel");
+      pid_t pid = fork();
+      if (pid < 0)
+        unix_error("fork error in eval_traces_parallel");
+      if (pid == 0) {
+        close(pipefd[0]);
+        verbose = 0; /* the parent prints the merged table */
+        range_t *ranges = NULL;
+        speed_t speed_params;
+        stats_t st;
+        memset(&st, 0, sizeof(st));
+        run_tests(tracefiles[next], &st, ranges, &speed_params);
+        if (write(pipefd[1], &st, sizeof(st)) != sizeof(st))
+          _exit(2);
+        _exit(st.valid ? EXIT_SUCCESS : EXIT_FAILURE);
+      }
+      close(pipefd[1]);
+      fds[next] = pipefd[0];
+      next++;
+      running++;
+    }
+    if (wait(NULL) > 0)
+      running--;
+  }
+
+  /* A child's single write of a stats_t is well under PIPE_BUF, so one
+   * read gets either the whole struct or nothing (the child died). */
+  int failed = 0;
+  double ops = 0, secs = 0;
+  long used = 0, total = 0;
+  printf("\nResults for mm malloc (%d traces, %d workers):\n", ntraces, jobs);
+  printheader();
+  for (int i = 0; i < ntraces; i++) {
+    ssize_t got = read(fds[i], &stats[i], sizeof(stats[i]));
+    close(fds[i]);
+    if (got != (ssize_t)sizeof(stats[i])) {
+      stats[i].valid = 0;
+      strcpy(stats[i].filename, tracefiles[i]);
+    }
+    if (stats[i].valid) {
+      used += stats[i].used;
+      total += stats[i].total;
+      ops += stats[i].ops;
+      secs += stats[i].secs;
+    } else {
+      failed++;
+    }
+    printresults_row(&stats[i]);
+  }
+  printf("%d/%d traces valid; aggregate util %.1f%%, %.0f ops in "
+         "%.6f secs (%.0f Kops)\n",
+         ntraces - failed, ntraces, total ? 100.0 * used / total : 0, ops,
+         secs, secs > 0 ? ops / (1E3 * secs) : 0);
+
+  if (json_out != NULL)
+    write_results_json(json_out, stats, ntraces);
+
+  free(stats);
+  free(fds);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 /**************
  * Main routine
  **************/
@@ -235,6 +458,10 @@ int main(int argc, char **argv) {
   stats_t mm_stats;       /* mm (i.e. student) stats for trace */
   speed_t speed_params;   /* input parameters to the xx_speed routines */
   int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  int jobs = 0;           /* parallel workers for multi-trace runs (-j) */
+  char *compile_out = NULL; /* write trace as binary here and exit (-c) */
+  char *impl_name = NULL;   /* allocator to run (-A); "all" compares them */
+  long trace_ring = 0;      /* event-ring records for -T (0 = off) */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
@@ -243,12 +470,48 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv, "A:b:c:d:f:j:J:t:T:v:w:hHVlD")) != EOF) {
     switch (c) {
+      case 'A': /* Select a registered allocator ("all": compare them) */
+        impl_name = strdup(optarg);
+        break;
+
+      case 'J': /* Also write per-trace results as JSON to <file> */
+        json_out = strdup(optarg);
+        break;
+
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         tracefile = strdup(optarg);
         break;
 
+      case 'c': /* Compile the trace into the binary format and exit */
+        compile_out = strdup(optarg);
+        break;
+
+      case 'j': /* Cap on concurrent workers for multi-trace runs */
+        jobs = atoi(optarg);
+        break;
+
+      case 'b': /* Benchmark: time N repetitions, report min/median/stddev */
+        bench_reps = atoi(optarg);
+        break;
+
+      case 'w': /* Untimed warmup repetitions before the -b measurements */
+        bench_warmup = atoi(optarg);
+        break;
+
+      case 't': /* Replay the trace over N threads after the timed run */
+        mt_threads = atoi(optarg);
+        break;
+
+      case 'T': /* Arm the allocator's event ring with N records */
+        trace_ring = atol(optarg);
+        break;
+
+      case 'H': /* Back the heap with 2 MiB huge pages (see memlib.c) */
+        setenv("MM_HUGEPAGES", "1", 1);
+        break;
+
       case 'l': /* Run libc malloc */
         run_libc = 1;
         break;
@@ -279,14 +542,107 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (tracefile == NULL) {
+  /* Resolve the allocator under test; the registry's first entry (mm.c's
+   * segregated lists) is the default. */
+  impl = allocators[0];
+  int run_all = 0;
+  if (impl_name != NULL) {
+    if (strcmp(impl_name, "all") == 0) {
+      run_all = 1;
+    } else {
+      impl = NULL;
+      for (int i = 0; allocators[i] != NULL; i++)
+        if (strcmp(allocators[i]->name, impl_name) == 0)
+          impl = allocators[i];
+      if (impl == NULL) {
+        fprintf(stderr, "Unknown allocator '%s'; registered:", impl_name);
+        for (int i = 0; allocators[i] != NULL; i++)
+          fprintf(stderr, " %s", allocators[i]->name);
+        fprintf(stderr, "\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Trace files: -f plus any positional arguments */
+  int ntraces = (tracefile != NULL) + (argc - optind);
+  if (ntraces == 0) {
     usage();
     exit(EXIT_FAILURE);
   }
+  char **tracefiles = (char **)malloc(ntraces * sizeof(char *));
+  if (tracefiles == NULL)
+    unix_error("malloc error in main");
+  ntraces = 0;
+  if (tracefile != NULL)
+    tracefiles[ntraces++] = tracefile;
+  for (int i = optind; i < argc; i++)
+    tracefiles[ntraces++] = argv[i];
+  tracefile = tracefiles[0];
 
   if (debug_mode != DBG_NONE)
     init_random_data();
 
+  /* Convert mode: parse, dump the compiled form, done */
+  if (compile_out != NULL) {
+    stats_t st;
+    trace_t *trace = read_trace(&st, tracefile);
+    write_trace_bin(trace, compile_out);
+    if (verbose)
+      printf("Compiled %s (%d ops) into %s\n", tracefile, trace->num_ops,
+             compile_out);
+    free_trace(trace);
+    return EXIT_SUCCESS;
+  }
+
+  /* Several traces: fork one worker per trace and merge the results */
+  if (ntraces > 1) {
+    if (run_libc)
+      app_error("-l supports a single trace file only");
+    if (run_all)
+      app_error("-A all supports a single trace file only");
+    if (trace_ring > 0)
+      app_error("-T supports a single trace file only");
+    return eval_traces_parallel(tracefiles, ntraces, jobs);
+  }
+
+  /* Arm the allocator's event ring before any replay touches it. */
+  if (trace_ring > 0) {
+    if (run_libc || run_all)
+      app_error("-T cannot be combined with -l or -A all");
+    if (impl->trace_start == NULL)
+      app_error("allocator '%s' does not support event tracing", impl->name);
+    if (impl->trace_start(trace_ring) < 0)
+      unix_error("could not arm the event ring");
+  }
+
+  /* Comparison mode: replay the trace once per registered allocator and
+   * print one table row for each. */
+  if (run_all) {
+    if (run_libc)
+      app_error("-A all cannot be combined with -l");
+    printheader();
+    int nimpl = 0;
+    while (allocators[nimpl] != NULL)
+      nimpl++;
+    stats_t *all_st = (stats_t *)calloc(nimpl, sizeof(stats_t));
+    if (all_st == NULL)
+      unix_error("malloc error in main");
+    int failed = 0;
+    for (int i = 0; i < nimpl; i++) {
+      impl = allocators[i];
+      run_tests(tracefile, &all_st[i], ranges, &speed_params);
+      snprintf(all_st[i].filename, sizeof(all_st[i].filename), "%s (%s)",
+               tracefile, impl->name);
+      printresults_row(&all_st[i]);
+      failed += !all_st[i].valid;
+    }
+    if (json_out != NULL)
+      write_results_json(json_out, all_st, nimpl);
+    free(all_st);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
   if (run_libc) {
     /*
      * Run and evaluate the libc malloc package
@@ -297,11 +653,16 @@ int main(int argc, char **argv) {
     /* Evaluate the libc malloc package using the K-best scheme */
     trace_t *trace = read_trace(&libc_stats, tracefile);
 
+    struct rusage ru_start, ru_end;
+    getrusage(RUSAGE_SELF, &ru_start);
     libc_stats.valid = eval_libc_valid(trace);
     if (libc_stats.valid) {
       speed_params.trace = trace;
       libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
     }
+    getrusage(RUSAGE_SELF, &ru_end);
+    libc_stats.pagefaults = (ru_end.ru_minflt - ru_start.ru_minflt) +
+                            (ru_end.ru_majflt - ru_start.ru_majflt);
     free_trace(trace);
 
     /* Display the libc results in a compact table */
@@ -310,6 +671,8 @@ int main(int argc, char **argv) {
       printresults(&libc_stats);
     }
 
+    if (json_out != NULL)
+      write_results_json(json_out, &libc_stats, 1);
     return libc_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
   }
 
@@ -328,6 +691,19 @@ int main(int argc, char **argv) {
     printresults(&mm_stats);
   }
 
+  if (json_out != NULL)
+    write_results_json(json_out, &mm_stats, 1);
+
+  /* Dump the tail of the event ring captured during the replay. */
+  if (trace_ring > 0) {
+    int fd = open("mm-trace.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      unix_error("Could not open mm-trace.out");
+    impl->trace_dump(fd);
+    close(fd);
+    if (verbose)
+      printf("Event trace written to mm-trace.out\n");
+  }
   return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
@@ -503,11 +879,35 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   if (!(tracefile = fopen(trace->filename, "r")))
     unix_error("Could not open %s in read_trace", trace->filename);
 
+  /* A compiled binary trace? Zero-copy map the ops array and skip the
+   * line parser entirely (see repb_header_t). */
+  repb_header_t hdr;
+  trace->map = NULL;
+  if (fread(&hdr, sizeof(hdr), 1, tracefile) == 1 && hdr.magic == REPB_MAGIC) {
+    if (hdr.version != REPB_VERSION)
+      app_error("%s: unsupported binary trace version %u", trace->filename,
+                hdr.version);
+    trace->weight = hdr.weight;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = hdr.num_ops;
+    trace->ignore_ranges = hdr.ignore_ranges;
+    trace->map_len = sizeof(hdr) + (size_t)hdr.num_ops * sizeof(traceop_t);
+    trace->map =
+      mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+      unix_error("mmap failed in read_trace");
+    trace->ops = (traceop_t *)((char *)trace->map + sizeof(hdr));
+  } else {
+    rewind(tracefile);
+  }
+
   int ignore = 0;
-  ignore += fscanf(tracefile, "%d", &trace->weight);
-  ignore += fscanf(tracefile, "%d", &trace->num_ids);
-  ignore += fscanf(tracefile, "%d", &trace->num_ops);
-  ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+  if (trace->map == NULL) {
+    ignore += fscanf(tracefile, "%d", &trace->weight);
+    ignore += fscanf(tracefile, "%d", &trace->num_ids);
+    ignore += fscanf(tracefile, "%d", &trace->num_ops);
+    ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
+  }
 
   if (trace->weight < 0 || trace->weight > 3)
     app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
@@ -515,7 +915,8 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
     app_error("%s: ignore-ranges can only be zero or one", trace->filename);
 
   /* We'll store each request line in the trace in this array */
-  if (!(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
+  if (trace->map == NULL &&
+      !(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
     unix_error("malloc 2 failed in read_trace");
 
   /* We'll keep an array of pointers to the allocated blocks here... */
@@ -537,22 +938,59 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   int max_index = 0;
   char type[MAXLINE];
   int size;
+  unsigned align;
 
-  while (fscanf(tracefile, "%s", type) != EOF) {
+  while (trace->map == NULL && fscanf(tracefile, "%s", type) != EOF) {
     switch (type[0]) {
       case 'a':
         ignore += fscanf(tracefile, "%u %u", &index, &size);
         trace->ops[op_index].type = ALLOC;
         trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
+        trace->ops[op_index].align = 0;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
+      case 'm': /* "m <index> <align> <size>": aligned_alloc request */
+        ignore += fscanf(tracefile, "%u %u %u", &index, &align, &size);
+        if (align < ALIGNMENT || (align & (align - 1)))
+          app_error("%s: bogus alignment %u", trace->filename, align);
+        trace->ops[op_index].type = MEMALIGN;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        trace->ops[op_index].align = align;
         max_index = (index > max_index) ? index : max_index;
         break;
 
+      case 'b': /* "b <index> <n> <size>": batch of n allocs of one size,
+                 * filling indices index..index+n-1 */
+        ignore += fscanf(tracefile, "%u %u %u", &index, &align, &size);
+        if (align == 0)
+          app_error("%s: empty batch", trace->filename);
+        trace->ops[op_index].type = BALLOC;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        trace->ops[op_index].align = align;
+        if ((int)(index + align - 1) > max_index)
+          max_index = index + align - 1;
+        break;
+
+      case 'd': /* "d <index> <n>": batch free of indices index..index+n-1 */
+        ignore += fscanf(tracefile, "%u %u", &index, &align);
+        if (align == 0)
+          app_error("%s: empty batch", trace->filename);
+        trace->ops[op_index].type = BFREE;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = 0;
+        trace->ops[op_index].align = align;
+        break;
+
       case 'r':
         ignore += fscanf(tracefile, "%u %u", &index, &size);
         trace->ops[op_index].type = REALLOC;
         trace->ops[op_index].index = index;
         trace->ops[op_index].size = size;
+        trace->ops[op_index].align = 0;
         max_index = (index > max_index) ? index : max_index;
         break;
 
@@ -560,6 +998,7 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
         ignore += fscanf(tracefile, "%ud", &index);
         trace->ops[op_index].type = FREE;
         trace->ops[op_index].index = index;
+        trace->ops[op_index].align = 0;
         break;
 
       default:
@@ -572,8 +1011,10 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   }
 
   fclose(tracefile);
-  assert(max_index == trace->num_ids - 1);
-  assert(trace->num_ops == op_index);
+  if (trace->map == NULL) {
+    assert(max_index == trace->num_ids - 1);
+    assert(trace->num_ops == op_index);
+  }
 
   /* fill in the stats */
   strcpy(stats->filename, trace->filename);
@@ -583,6 +1024,25 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
   return trace;
 }
 
+/*
+ * write_trace_bin - Compile a parsed trace into the binary format
+ * (repb_header_t plus the raw traceop_t array) that read_trace mmaps
+ * back without any parsing.
+ */
+static void write_trace_bin(const trace_t *trace, const char *outfile) {
+  FILE *f = fopen(outfile, "w");
+  if (f == NULL)
+    unix_error("Could not open %s in write_trace_bin", outfile);
+
+  repb_header_t hdr = {REPB_MAGIC,     REPB_VERSION,  trace->weight,
+                       trace->num_ids, trace->num_ops, trace->ignore_ranges};
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, f) !=
+        (size_t)trace->num_ops)
+    unix_error("Write failed in write_trace_bin");
+  fclose(f);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -597,7 +1057,10 @@ static void reinit_trace(trace_t *trace) {
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
-  free(trace->ops); /* free the three arrays... */
+  if (trace->map) /* free the three arrays... */
+    munmap(trace->map, trace->map_len);
+  else
+    free(trace->ops);
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
@@ -619,7 +1082,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
   reinit_trace(trace);
 
   /* Call the mm package's init function */
-  if (mm_init() < 0) {
+  if (impl->init() < 0) {
     malloc_error(trace, 0, "mm_init failed.");
     return 0;
   }
@@ -634,7 +1097,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
 
     if (debug_mode == DBG_EXPENSIVE) {
       /* Let the students check their own heap */
-      mm_checkheap(verbose);
+      impl->checkheap(verbose);
 
       /* Now check that all our allocated blocks have the right data */
       range_t *r = *ranges;
@@ -647,7 +1110,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
         /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
+        if ((p = impl->malloc(size)) == NULL) {
           malloc_error(trace, i, "mm_malloc failed.");
           return 0;
         }
@@ -668,12 +1131,84 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         randomize_block(trace, index);
         break;
 
+      case MEMALIGN: /* mm_aligned_alloc */
+        if (impl->memalign == NULL) {
+          malloc_error(trace, i, "allocator %s has no aligned_alloc.",
+                       impl->name);
+          return 0;
+        }
+        if ((p = impl->memalign(trace->ops[i].align, size)) == NULL) {
+          malloc_error(trace, i, "mm_aligned_alloc failed.");
+          return 0;
+        }
+
+        /* On top of the usual checks, the payload must honor the
+         * requested alignment. */
+        if ((unsigned long)p % trace->ops[i].align) {
+          malloc_error(trace, i, "Payload address (%p) not aligned to %zu "
+                       "bytes", p, trace->ops[i].align);
+          return 0;
+        }
+        if (add_range(ranges, p, size, trace, i, index) == 0)
+          return 0;
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+        randomize_block(trace, index);
+        break;
+
+      case BALLOC: /* mm_malloc_batch */
+      case BFREE: { /* mm_free_batch */
+        size_t count = trace->ops[i].align;
+        void **batch = malloc(count * sizeof(void *));
+        if (batch == NULL)
+          unix_error("malloc error in eval_mm_valid");
+
+        if (trace->ops[i].type == BALLOC) {
+          if (impl->malloc_batch == NULL) {
+            malloc_error(trace, i, "allocator %s has no malloc_batch.",
+                         impl->name);
+            free(batch);
+            return 0;
+          }
+          if (impl->malloc_batch(size, count, batch) != count) {
+            malloc_error(trace, i, "mm_malloc_batch failed.");
+            free(batch);
+            return 0;
+          }
+          for (size_t k = 0; k < count; k++) {
+            if (add_range(ranges, batch[k], size, trace, i, index + k) == 0) {
+              free(batch);
+              return 0;
+            }
+            trace->blocks[index + k] = batch[k];
+            trace->block_sizes[index + k] = size;
+            randomize_block(trace, index + k);
+          }
+        } else {
+          if (impl->free_batch == NULL) {
+            malloc_error(trace, i, "allocator %s has no free_batch.",
+                         impl->name);
+            free(batch);
+            return 0;
+          }
+          for (size_t k = 0; k < count; k++) {
+            check_index(trace, i, index + k);
+            batch[k] = trace->blocks[index + k];
+            remove_range(ranges, batch[k]);
+          }
+          impl->free_batch(batch, count);
+        }
+        free(batch);
+        break;
+      }
+
       case REALLOC: /* mm_realloc */
         check_index(trace, i, index);
 
         /* Call the student's realloc */
         oldp = trace->blocks[index];
-        newp = mm_realloc(oldp, size);
+        newp = impl->realloc(oldp, size);
         if ((newp == NULL) && (size != 0)) {
           malloc_error(trace, i, "mm_realloc failed.");
           return 0;
@@ -712,7 +1247,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
           p = trace->blocks[index];
           remove_range(ranges, p);
         }
-        mm_free(p);
+        impl->free(p);
         break;
 
       default:
@@ -744,7 +1279,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (impl->init() < 0)
     app_error("trace: mm_init failed in eval_mm_util");
 
   for (int i = 0; i < trace->num_ops; i++) {
@@ -756,7 +1291,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = impl->malloc(size)) == NULL)
           app_error("trace: mm_malloc failed in eval_mm_util");
 
         /* Remember region and size */
@@ -766,13 +1301,56 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         total_size += size;
         break;
 
+      case MEMALIGN: /* mm_aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if (impl->memalign == NULL ||
+            (p = impl->memalign(trace->ops[i].align, size)) == NULL)
+          app_error("trace: mm_aligned_alloc failed in eval_mm_util");
+
+        trace->blocks[index] = p;
+        trace->block_sizes[index] = size;
+
+        total_size += size;
+        break;
+
+      case BALLOC: /* mm_malloc_batch */
+      case BFREE: { /* mm_free_batch */
+        size_t count = trace->ops[i].align;
+        void **batch = malloc(count * sizeof(void *));
+        if (batch == NULL)
+          unix_error("malloc error in eval_mm_util");
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+
+        if (trace->ops[i].type == BALLOC) {
+          if (impl->malloc_batch == NULL ||
+              impl->malloc_batch(size, count, batch) != count)
+            app_error("trace: mm_malloc_batch failed in eval_mm_util");
+          for (size_t k = 0; k < count; k++) {
+            trace->blocks[index + k] = batch[k];
+            trace->block_sizes[index + k] = size;
+            total_size += size;
+          }
+        } else {
+          for (size_t k = 0; k < count; k++) {
+            batch[k] = trace->blocks[index + k];
+            total_size -= trace->block_sizes[index + k];
+          }
+          impl->free_batch(batch, count);
+        }
+        free(batch);
+        break;
+      }
+
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
         oldsize = trace->block_sizes[index];
 
         oldp = trace->blocks[index];
-        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+        if ((newp = impl->realloc(oldp, newsize)) == NULL && newsize != 0)
           app_error("trace: mm_realloc failed in eval_mm_util");
 
         /* Remember region and size */
@@ -792,7 +1370,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
           p = trace->blocks[index];
         }
 
-        mm_free(p);
+        impl->free(p);
 
         total_size -= size;
         break;
@@ -822,7 +1400,7 @@ static void eval_mm_speed(void *ptr) {
 
   /* Reset the heap and initialize the mm package */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (impl->init() < 0)
     app_error("mm_init failed in eval_mm_speed");
 
   /* Interpret each trace request */
@@ -834,16 +1412,42 @@ static void eval_mm_speed(void *ptr) {
       case ALLOC: /* mm_malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = impl->malloc(size)) == NULL)
           app_error("mm_malloc error in eval_mm_speed");
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* mm_aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if (impl->memalign == NULL ||
+            (p = impl->memalign(trace->ops[i].align, size)) == NULL)
+          app_error("mm_aligned_alloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case BALLOC: /* mm_malloc_batch */
+      case BFREE: { /* mm_free_batch */
+        size_t count = trace->ops[i].align;
+        index = trace->ops[i].index;
+        if (trace->ops[i].type == BALLOC) {
+          if (impl->malloc_batch == NULL ||
+              impl->malloc_batch(trace->ops[i].size, count,
+                                 (void **)&trace->blocks[index]) != count)
+            app_error("mm_malloc_batch error in eval_mm_speed");
+        } else {
+          /* blocks[] doubles as the scratch array; the replay never
+           * reads a freed slot again. */
+          impl->free_batch((void **)&trace->blocks[index], count);
+        }
+        break;
+      }
+
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
         oldp = trace->blocks[index];
-        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+        if ((newp = impl->realloc(oldp, newsize)) == NULL && newsize != 0)
           app_error("mm_realloc error in eval_mm_speed");
         trace->blocks[index] = newp;
         break;
@@ -855,7 +1459,7 @@ static void eval_mm_speed(void *ptr) {
         } else {
           block = trace->blocks[index];
         }
-        mm_free(block);
+        impl->free(block);
         break;
 
       default:
@@ -864,6 +1468,139 @@ static void eval_mm_speed(void *ptr) {
   }
 }
 
+/*****************************************************************
+ * Threaded trace replay (-t N). The operation stream is sharded
+ * round-robin over N worker threads, so a block allocated by one
+ * thread is routinely freed by another. Handoff is synchronized per
+ * block index: every op on an index gets a precomputed generation
+ * number, a worker spins until the index reaches its op's generation,
+ * and bumps it when done. Dependencies always point at earlier trace
+ * positions and each worker runs its ops in trace order, so the replay
+ * cannot deadlock. Only meaningful against a thread-safe allocator
+ * (mdriver-mt).
+ ****************************************************************/
+
+typedef struct {
+  trace_t *trace;
+  int nthreads;
+  int id;
+  const unsigned *op_gen; /* generation each op waits for on its index */
+  volatile unsigned *gen; /* per-index generation counters */
+  int ops;                /* ops this worker executed */
+  double secs;            /* this worker's wall time */
+} mt_worker_t;
+
+static void *mm_speed_mt_worker(void *ptr) {
+  mt_worker_t *w = (mt_worker_t *)ptr;
+  trace_t *trace = w->trace;
+  struct timeval stv, etv;
+
+  gettimeofday(&stv, NULL);
+  for (int i = w->id; i < trace->num_ops; i += w->nthreads) {
+    int index = trace->ops[i].index;
+    int size = trace->ops[i].size;
+    char *p, *newp;
+
+    /* Wait until the previous op on this index has published its result */
+    if (index >= 0)
+      while (__atomic_load_n(&w->gen[index], __ATOMIC_ACQUIRE) != w->op_gen[i])
+        sched_yield();
+
+    switch (trace->ops[i].type) {
+      case ALLOC:
+        if ((p = impl->malloc(size)) == NULL)
+          app_error("mm_malloc error in eval_mm_speed_mt");
+        trace->blocks[index] = p;
+        break;
+
+      case MEMALIGN:
+        if (impl->memalign == NULL ||
+            (p = impl->memalign(trace->ops[i].align, size)) == NULL)
+          app_error("mm_aligned_alloc error in eval_mm_speed_mt");
+        trace->blocks[index] = p;
+        break;
+
+      case BALLOC:
+      case BFREE:
+        /* The per-index handoff protocol covers one index per op. */
+        app_error("batch ops are not supported in the threaded replay");
+        break;
+
+      case REALLOC:
+        newp = impl->realloc(trace->blocks[index], size);
+        if (newp == NULL && size != 0)
+          app_error("mm_realloc error in eval_mm_speed_mt");
+        trace->blocks[index] = newp;
+        break;
+
+      case FREE:
+        impl->free(index >= 0 ? trace->blocks[index] : NULL);
+        break;
+
+      default:
+        app_error("Nonexistent request type in eval_mm_speed_mt");
+    }
+
+    if (index >= 0)
+      __atomic_store_n(&w->gen[index], w->op_gen[i] + 1, __ATOMIC_RELEASE);
+    w->ops++;
+  }
+  gettimeofday(&etv, NULL);
+  w->secs = (etv.tv_sec - stv.tv_sec) + 1E-6 * (etv.tv_usec - stv.tv_usec);
+  return NULL;
+}
+
+static void eval_mm_speed_mt(trace_t *trace, int nthreads) {
+  unsigned *op_gen, *cnt;
+  volatile unsigned *gen;
+  mt_worker_t workers[nthreads];
+  pthread_t tids[nthreads];
+  struct timeval stv, etv;
+
+  /* Number the ops on each index: op k on index i runs at generation k */
+  op_gen = (unsigned *)calloc(trace->num_ops, sizeof(unsigned));
+  cnt = (unsigned *)calloc(trace->num_ids, sizeof(unsigned));
+  gen = (volatile unsigned *)calloc(trace->num_ids, sizeof(unsigned));
+  if (op_gen == NULL || cnt == NULL || gen == NULL)
+    unix_error("calloc error in eval_mm_speed_mt");
+  for (int i = 0; i < trace->num_ops; i++) {
+    int index = trace->ops[i].index;
+    if (index >= 0)
+      op_gen[i] = cnt[index]++;
+  }
+  free(cnt);
+
+  reinit_trace(trace);
+  mem_reset_brk();
+  if (impl->init() < 0)
+    app_error("mm_init failed in eval_mm_speed_mt");
+
+  gettimeofday(&stv, NULL);
+  for (int t = 0; t < nthreads; t++) {
+    workers[t] = (mt_worker_t){
+      .trace = trace, .nthreads = nthreads, .id = t, .op_gen = op_gen,
+      .gen = gen,
+    };
+    if (pthread_create(&tids[t], NULL, mm_speed_mt_worker, &workers[t]) != 0)
+      unix_error("pthread_create error in eval_mm_speed_mt");
+  }
+  for (int t = 0; t < nthreads; t++)
+    pthread_join(tids[t], NULL);
+  gettimeofday(&etv, NULL);
+  double wall = (etv.tv_sec - stv.tv_sec) + 1E-6 * (etv.tv_usec - stv.tv_usec);
+
+  printf("\nThreaded replay (%d threads):\n", nthreads);
+  for (int t = 0; t < nthreads; t++)
+    printf("  thread %d: %8d ops in %.6f secs (%6.0f Kops)\n", t,
+           workers[t].ops, workers[t].secs,
+           workers[t].secs > 0 ? workers[t].ops / (1E3 * workers[t].secs) : 0);
+  printf("  aggregate: %7d ops in %.6f secs (%6.0f Kops)\n", trace->num_ops,
+         wall, wall > 0 ? trace->num_ops / (1E3 * wall) : 0);
+
+  free(op_gen);
+  free((void *)gen);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -886,6 +1623,30 @@ static int eval_libc_valid(trace_t *trace) {
         trace->blocks[trace->ops[i].index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+            NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
+      case BALLOC: /* libc has no batch API: the plain loop is the baseline */
+        for (size_t k = 0; k < trace->ops[i].align; k++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL) {
+            malloc_error(trace, i, "libc malloc failed");
+            unix_error("System message");
+          }
+          trace->blocks[trace->ops[i].index + k] = p;
+        }
+        break;
+
+      case BFREE:
+        for (size_t k = 0; k < trace->ops[i].align; k++)
+          free(trace->blocks[trace->ops[i].index + k]);
+        break;
+
       case REALLOC: /* realloc */
         newsize = trace->ops[i].size;
         oldp = trace->blocks[trace->ops[i].index];
@@ -935,6 +1696,29 @@ static void eval_libc_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        index = trace->ops[i].index;
+        if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) ==
+            NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
+      case BALLOC: /* libc has no batch API: the plain loop is the baseline */
+        index = trace->ops[i].index;
+        for (size_t k = 0; k < trace->ops[i].align; k++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL)
+            unix_error("malloc failed in eval_libc_speed");
+          trace->blocks[index + k] = p;
+        }
+        break;
+
+      case BFREE:
+        index = trace->ops[i].index;
+        for (size_t k = 0; k < trace->ops[i].align; k++)
+          free(trace->blocks[index + k]);
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -965,10 +1749,12 @@ static void eval_libc_speed(void *ptr) {
 /*
  * printresults - prints a performance summary for some malloc package
  */
-static void printresults(stats_t *stats) {
-  /* Print the individual results for each trace */
-  printf("  %2s%6s%8s%8s %5s%8s%10s  %s\n", "valid", "util", "used", "total",
-         "ops", "secs", "Kops", "trace");
+static void printheader(void) {
+  printf("  %2s%6s%8s%8s %5s%8s%10s%9s  %s\n", "valid", "util", "used",
+         "total", "ops", "secs", "Kops", "faults", "trace");
+}
+
+static void printresults_row(stats_t *stats) {
   if (!stats->valid) {
     printf("%2s%4s %6s%8s%10s%7s %s\n", stats->weight != 0 ? "*" : "", "no",
            "-", "-", "-", "-", stats->filename);
@@ -1011,9 +1797,41 @@ static void printresults(stats_t *stats) {
   else
     printf("%8s%10s%7s", "--", "--", "--");
 
+  printf("%9ld", stats->pagefaults);
   printf(" %s\n", stats->filename);
 }
 
+static void printresults(stats_t *stats) {
+  /* Print the individual results for each trace */
+  printheader();
+  printresults_row(stats);
+}
+
+/*
+ * write_results_json - write the per-trace results as a JSON array
+ * (-J <file>), one record per trace, for machine consumers such as
+ * grade.py's regression gate. Mirrors the columns of the text table.
+ */
+static void write_results_json(const char *path, stats_t *stats, int n) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    unix_error("Could not open %s in write_results_json", path);
+  fprintf(f, "[\n");
+  for (int i = 0; i < n; i++) {
+    stats_t *st = &stats[i];
+    fprintf(f,
+            "  {\"trace\": \"%s\", \"valid\": %s, \"util\": %.4f, "
+            "\"used\": %d, \"total\": %d, \"ops\": %.0f, \"secs\": %.6f, "
+            "\"kops\": %.0f, \"pagefaults\": %ld}%s\n",
+            st->filename, st->valid ? "true" : "false",
+            st->valid ? st->util : 0.0, st->used, st->total, st->ops, st->secs,
+            st->secs > 0 ? (st->ops / 1e3) / st->secs : 0.0, st->pagefaults,
+            i + 1 < n ? "," : "");
+  }
+  fprintf(f, "]\n");
+  fclose(f);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1054,12 +1872,37 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr, "Usage: mdriver [-hHlVD] [-A <name>] [-b <n>] [-w <n>] "
+                  "[-d <i>] [-v <i>] [-t <n>] [-T <n>] [-j <n>] [-J <file>] "
+                  "[-f <file>] [file...]\n");
   fprintf(stderr, "Options\n");
+  fprintf(stderr, "\t-A <name>  Run the named registered allocator\n");
+  fprintf(stderr, "\t           (default: seglist); \"all\" replays the\n");
+  fprintf(stderr, "\t           trace under every allocator and prints a\n");
+  fprintf(stderr, "\t           comparison table.\n");
+  fprintf(stderr, "\t-b <n>     Benchmark: time <n> repetitions of the\n");
+  fprintf(stderr, "\t           trace, report min/median/mean/stddev.\n");
+  fprintf(stderr, "\t-c <file>  Compile the -f trace into binary <file>\n");
+  fprintf(stderr, "\t           (loaded back with a zero-copy mmap).\n");
+  fprintf(stderr, "\t-j <n>     With several trace files, run at most <n>\n");
+  fprintf(stderr, "\t           forked workers at a time (default: cores).\n");
+  fprintf(stderr, "\t-J <file>  Also write the per-trace results to <file>\n");
+  fprintf(stderr, "\t           as a JSON array (for grade.py and CI).\n");
+  fprintf(stderr, "\t-w <n>     Untimed warmup repetitions for -b "
+                  "(default 3).\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
   fprintf(stderr, "\t-h         Print this message.\n");
+  fprintf(stderr, "\t-H         Back the heap with 2 MiB huge pages\n");
+  fprintf(stderr, "\t           (MAP_HUGETLB, falling back to transparent\n");
+  fprintf(stderr, "\t           huge pages); same as MM_HUGEPAGES=1.\n");
   fprintf(stderr, "\t-l         Run libc malloc instead mm.\n");
+  fprintf(stderr, "\t-t <n>     Also replay the trace over <n> threads\n");
+  fprintf(stderr, "\t           (requires a thread-safe allocator, see\n");
+  fprintf(stderr, "\t           the mdriver-mt target).\n");
+  fprintf(stderr, "\t-T <n>     Arm the allocator's event ring with <n>\n");
+  fprintf(stderr, "\t           records; dump its tail to mm-trace.out\n");
+  fprintf(stderr, "\t           after the replay.\n");
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
@@ -0,0 +1,164 @@
+/*
+ * memlib-real.c - the memlib interface over a real backing store, for
+ * the preloadable libmmalloc.so build. Instead of the driver's
+ * simulated heap, the whole MAX_HEAP region is mapped up front at the
+ * fixed base the allocator's compressed offsets assume (untouched pages
+ * cost nothing with MAP_NORESERVE), and mm_init runs from a constructor
+ * or lazily from the first malloc that beats the constructor.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* The base ptr_address() in mm.c hardcodes. */
+#define HEAP_BASE ((void *)0x800000000L)
+
+/* private variables */
+static unsigned char *heap;
+static unsigned char *mem_brk;
+static unsigned char *mem_max_addr;
+
+/*
+ * mem_init - map the heap region at its fixed base
+ *
+ * MM_HUGEPAGES=1 backs the heap with 2 MiB pages, the same way the
+ * simulator does: MAP_HUGETLB first, transparent-hugepage madvise as
+ * the fallback when the hugetlb pool is empty.
+ */
+void mem_init(void) {
+  const int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE |
+                    MAP_FIXED_NOREPLACE;
+  const char *huge = getenv("MM_HUGEPAGES");
+
+  heap = MAP_FAILED;
+  if (huge != NULL && *huge != '0')
+    heap = mmap(HEAP_BASE, MAX_HEAP, PROT_READ | PROT_WRITE,
+                flags | MAP_HUGETLB, -1, 0);
+  if (heap == MAP_FAILED) {
+    heap = mmap(HEAP_BASE, MAX_HEAP, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (huge != NULL && *huge != '0' && heap != MAP_FAILED)
+      madvise(heap, MAX_HEAP, MADV_HUGEPAGE);
+  }
+  if (heap != HEAP_BASE)
+    abort(); /* compressed offsets require this exact base */
+  mem_max_addr = heap + MAX_HEAP;
+  mem_brk = heap;
+}
+
+/*
+ * mem_deinit - free the storage used by the memory system
+ */
+void mem_deinit(void) {
+  munmap(heap, MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - reset the brk pointer to make an empty heap
+ */
+void mem_reset_brk(void) {
+  mem_brk = heap;
+}
+
+/*
+ * mem_sbrk - same contract as the simulator's: extend the heap by incr
+ *    bytes and return the start address of the new area. A negative incr
+ *    shrinks the heap and gives the released pages back to the OS.
+ */
+void *mem_sbrk(long incr) {
+  unsigned char *old_brk = mem_brk;
+
+  if (incr < 0) {
+    if (mem_brk + incr < heap) {
+      errno = EINVAL;
+      return (void *)-1;
+    }
+    mem_brk += incr;
+    mem_decommit(mem_brk, -incr);
+    return (void *)old_brk;
+  }
+
+  if ((mem_brk + incr) > mem_max_addr) {
+    errno = ENOMEM;
+    return (void *)-1;
+  }
+
+  mem_brk += incr;
+  return (void *)old_brk;
+}
+
+/*
+ * mem_decommit - give the physical pages backing [addr, addr + len) back
+ *    to the OS (MADV_DONTNEED); see memlib.c.
+ */
+void mem_decommit(void *addr, size_t len) {
+  size_t pagesize = mem_pagesize();
+  unsigned char *lo = (unsigned char *)(((unsigned long)addr + pagesize - 1) &
+                                        ~(pagesize - 1));
+  unsigned char *hi =
+    (unsigned char *)(((unsigned long)addr + len) & ~(pagesize - 1));
+
+  if (lo < hi)
+    madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_owns - does ptr lie inside our heap? A preloaded allocator also
+ *    sees pointers that predate it (ld.so, early libc); those belong to
+ *    somebody else.
+ */
+int mem_owns(void *ptr) {
+  return (unsigned char *)ptr >= heap && (unsigned char *)ptr < mem_brk;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo() {
+  return (void *)heap;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi() {
+  return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize() {
+  return (size_t)((void *)mem_brk - (void *)heap);
+}
+
+/*
+ * mem_pagesize() - returns the page size of the system
+ */
+size_t mem_pagesize() {
+  return (size_t)getpagesize();
+}
+
+/* ---- startup ---- */
+
+static pthread_once_t init_ctl = PTHREAD_ONCE_INIT;
+
+static void init_once(void) {
+  mem_init();
+  if (mm_init() < 0)
+    abort();
+}
+
+/* Idempotent; called from the constructor and from the allocator entry
+ * points, since a process may malloc before our constructor has run. */
+void mm_standalone_init(void) {
+  pthread_once(&init_ctl, init_once);
+}
+
+__attribute__((constructor)) static void mmlib_ctor(void) {
+  mm_standalone_init();
+}
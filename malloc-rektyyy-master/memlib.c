@@ -21,14 +21,31 @@ static unsigned char *mem_max_addr;
 
 /*
  * mem_init - initialize the memory system model
+ *
+ * With MM_HUGEPAGES set in the environment (driver flag -H) the heap is
+ * backed by 2 MiB pages: first a MAP_HUGETLB mapping from the
+ * preallocated hugetlb pool, and if the pool is empty a plain mapping
+ * with MADV_HUGEPAGE so the kernel assembles transparent huge pages
+ * behind it. MAX_HEAP is a multiple of 2 MiB and the fixed base is
+ * aligned, as MAP_HUGETLB requires.
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
+  const char *huge = getenv("MM_HUGEPAGES");
+
+  heap = MAP_FAILED;
+  if (huge != NULL && *huge != '0')
+    heap = mmap((void *)0x800000000, MAX_HEAP, PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+  if (heap == MAP_FAILED) {
+    heap = mmap((void *)0x800000000,    /* suggested start */
+                MAX_HEAP,               /* length */
+                PROT_WRITE,             /* permissions */
+                MAP_PRIVATE | MAP_ANON, /* private or shared? */
+                -1,                     /* fd */
+                0);                     /* offset (dunno) */
+    if (huge != NULL && *huge != '0')
+      madvise(heap, MAX_HEAP, MADV_HUGEPAGE);
+  }
   mem_max_addr = heap + MAX_HEAP;
   mem_brk = heap; /* heap is empty initially */
 }
@@ -49,13 +66,25 @@ void mem_reset_brk() {
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap; the released range stays mapped
+ *    but its physical pages go back to the OS (see mem_decommit).
  */
 void *mem_sbrk(long incr) {
   unsigned char *old_brk = mem_brk;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  if (incr < 0) {
+    if (mem_brk + incr < heap) {
+      errno = EINVAL;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below heap start...\n");
+      return (void *)-1;
+    }
+    mem_brk += incr;
+    mem_decommit(mem_brk, -incr);
+    return (void *)old_brk;
+  }
+
+  if ((mem_brk + incr) > mem_max_addr) {
     errno = ENOMEM;
     fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return (void *)-1;
@@ -65,6 +94,30 @@ void *mem_sbrk(long incr) {
   return (void *)old_brk;
 }
 
+/*
+ * mem_decommit - give the physical pages backing [addr, addr + len) back
+ *    to the OS (MADV_DONTNEED). The address range stays mapped and reads
+ *    as zeroes when touched again. Partial pages at either end are left
+ *    alone, so callers may pass unaligned ranges.
+ */
+void mem_decommit(void *addr, size_t len) {
+  size_t pagesize = mem_pagesize();
+  unsigned char *lo = (unsigned char *)(((unsigned long)addr + pagesize - 1) &
+                                        ~(pagesize - 1));
+  unsigned char *hi =
+    (unsigned char *)(((unsigned long)addr + len) & ~(pagesize - 1));
+
+  if (lo < hi)
+    madvise(lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_owns - does ptr lie inside the simulated heap?
+ */
+int mem_owns(void *ptr) {
+  return (unsigned char *)ptr >= heap && (unsigned char *)ptr < mem_brk;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
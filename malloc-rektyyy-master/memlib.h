@@ -14,9 +14,15 @@
 
 void mem_init(void);
 void mem_deinit(void);
+int mem_owns(void *ptr);
 void *mem_sbrk(long incr);
+void mem_decommit(void *addr, size_t len);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+
+/* libmmalloc.so (memlib-real.c) only: idempotent mem_init + mm_init, for
+ * allocations that arrive before the library constructor has run. */
+void mm_standalone_init(void);
@@ -1,3 +1,12 @@
+/*
+ * mm-implicit.c - the implicit-list baseline allocator.
+ *
+ * Blocks form one implicit list walked with boundary tags; there are no
+ * free lists, so every malloc scans the heap. This is the strategy
+ * mm.c's segregated lists replaced, kept alive as a registered
+ * comparison point (mdriver -A implicit). The entry points are static;
+ * only the registry record at the bottom is exported.
+ */
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
@@ -7,11 +16,10 @@
 #include <stddef.h>
 #include <unistd.h>
 
-#include "mm.h"
+#include "allocators.h"
 #include "memlib.h"
 
-/* If you want debugging output, use the following macro.
- * When you hand in, remove the #define DEBUG line. */
+/* If you want debugging output, use the following macro. */
 // #define DEBUG
 #ifdef DEBUG
 #define debug(fmt, ...) printf("%s: " fmt "\n", __func__, __VA_ARGS__)
@@ -23,15 +31,6 @@
 
 #define __unused __attribute__((unused))
 
-/* do not change the following! */
-#ifdef DRIVER
-/* create aliases for driver tests */
-#define malloc mm_malloc
-#define free mm_free
-#define realloc mm_realloc
-#define calloc mm_calloc
-#endif /* !DRIVER */
-
 typedef int32_t word_t; /* Heap is bascially an array of 4-byte words. */
 
 typedef enum {
@@ -42,7 +41,6 @@ typedef enum {
 
 static word_t *heap_start; /* Address of the first block */
 static word_t *heap_end;   /* Address past last byte of last block */
-static word_t *last;       /* Points at last block */
 
 /* --=[ boundary tag handling ]=-------------------------------------------- */
 
@@ -68,10 +66,6 @@ static inline word_t *bt_fromptr(void *ptr) {
   return (word_t *)ptr - 1;
 }
 
-/* Creates boundary tag(s) for given block. */
-static inline void bt_make(word_t *bt, size_t size, bt_flags flags) {
-}
-
 /* Previous block free flag handling for optimized boundary tags. */
 static inline bt_flags bt_get_prevfree(word_t *bt) {
   return *bt & PREVFREE;
@@ -93,10 +87,30 @@ static inline void *bt_payload(word_t *bt) {
 
 /* Returns address of next block or NULL. */
 static inline word_t *bt_next(word_t *bt) {
+  word_t *ptr = (void *)bt + bt_size(bt);
+  if (ptr <= heap_end)
+    return ptr;
+  return NULL;
 }
 
 /* Returns address of previous block or NULL. */
 static inline word_t *bt_prev(word_t *bt) {
+  word_t *ptr = (void *)bt - bt_size(bt - 1);
+  if (ptr >= heap_start)
+    return ptr;
+  return NULL;
+}
+
+/* Creates boundary tag(s) for given block. */
+static inline void bt_make(word_t *bt, size_t size, bt_flags flags) {
+  /* If the block is USED we need to make only header*/
+  *bt = size | flags;
+  bt_clr_prevfree(bt_next(bt));
+  /* If the block is FREE we need to make header and footer*/
+  if (bt_free(bt)) {
+    *bt_footer(bt) = size | flags;
+    bt_set_prevfree(bt_next(bt));
+  }
 }
 
 /* --=[ miscellanous procedures ]=------------------------------------------ */
@@ -104,6 +118,7 @@ static inline word_t *bt_prev(word_t *bt) {
 /* Calculates block size incl. header, footer & payload,
  * and aligns it to block boundary (ALIGNMENT). */
 static inline size_t blksz(size_t size) {
+  return (size + sizeof(word_t) + ALIGNMENT - 1) & -ALIGNMENT;
 }
 
 static void *morecore(size_t size) {
@@ -115,13 +130,17 @@ static void *morecore(size_t size) {
 
 /* --=[ mm_init ]=---------------------------------------------------------- */
 
-int mm_init(void) {
-  void *ptr = morecore(ALIGNMENT - sizeof(word_t));
+static int implicit_init(void) {
+  void *ptr = morecore(ALIGNMENT);
   if (!ptr)
     return -1;
-  heap_start = NULL;
-  heap_end = NULL;
-  last = NULL;
+  /* The last word of the padding is the epilogue: a zero-size used
+   * header that terminates heap walks and carries the PREVFREE bit of
+   * the block before it. Headers land at 12 mod 16, so payloads come
+   * out 16-aligned. */
+  heap_start = ptr + ALIGNMENT - sizeof(word_t);
+  heap_end = heap_start;
+  *heap_end = (word_t)USED;
   return 0;
 }
 
@@ -130,31 +149,127 @@ int mm_init(void) {
 #if 0
 /* First fit startegy. */
 static word_t *find_fit(size_t reqsz) {
+  for (word_t *bt = heap_start; bt < heap_end; bt = bt_next(bt))
+    if (bt_free(bt) && (size_t)bt_size(bt) >= reqsz)
+      return bt;
+  return NULL;
 }
 #else
 /* Best fit startegy. */
 static word_t *find_fit(size_t reqsz) {
+  word_t *best = NULL;
+  word_t bestsize = 0;
+  for (word_t *bt = heap_start; bt < heap_end; bt = bt_next(bt)) {
+    word_t size = bt_size(bt);
+    if (bt_free(bt) && (size_t)size >= reqsz &&
+        (best == NULL || size < bestsize)) {
+      best = bt;
+      bestsize = size;
+    }
+  }
+  return best;
 }
 #endif
 
-void *malloc(size_t size) {
+static void *implicit_malloc(size_t size) {
+  size_t asize = blksz(size);
+
+  word_t *bt = find_fit(asize);
+  if (bt != NULL) {
+    size_t rest = bt_size(bt) - asize;
+    if (rest >= 16) { /* 2 * ALIGNMENT */
+      bt_make(bt, asize, USED | bt_get_prevfree(bt));
+      bt_make(bt_next(bt), rest, FREE);
+    } else {
+      bt_make(bt, bt_size(bt), USED | bt_get_prevfree(bt));
+    }
+    return bt_payload(bt);
+  }
+
+  /* No fit: carve a fresh block at the top of the heap. */
+  if (morecore(asize) == NULL)
+    return NULL;
+  bt = heap_end;
+  word_t epilogue = *heap_end; /* carries PREVFREE of the last block */
+  heap_end = (void *)heap_end + asize;
+  *heap_end = (word_t)USED;
+  bt_make(bt, asize, USED | (epilogue & PREVFREE));
+  return bt_payload(bt);
 }
 
 /* --=[ free ]=------------------------------------------------------------- */
 
-void free(void *ptr) {
+static void implicit_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+  word_t *bt = bt_fromptr(ptr);
+  bt_make(bt, bt_size(bt), FREE | bt_get_prevfree(bt));
+
+  /* Coalesce with the neighbors (the epilogue reads as used). */
+  word_t *next = bt_next(bt);
+  if (next && bt_free(next))
+    bt_make(bt, bt_size(bt) + bt_size(next), FREE | bt_get_prevfree(bt));
+  if (bt_get_prevfree(bt)) {
+    word_t *prev = bt_prev(bt);
+    bt_make(prev, bt_size(prev) + bt_size(bt), FREE | bt_get_prevfree(prev));
+  }
 }
 
 /* --=[ realloc ]=---------------------------------------------------------- */
 
-void *realloc(void *old_ptr, size_t size) {
+static void *implicit_realloc(void *old_ptr, size_t size) {
+  if (old_ptr == NULL)
+    return implicit_malloc(size);
+  if (size == 0) {
+    implicit_free(old_ptr);
+    return NULL;
+  }
+
+  word_t *bt = bt_fromptr(old_ptr);
+  size_t blocksize = bt_size(bt);
+  size_t asize = blksz(size);
+
+  /* Shrink in place, splitting off the tail if it makes a block. */
+  if (asize <= blocksize) {
+    if (blocksize - asize >= 16) {
+      bt_make(bt, asize, USED | bt_get_prevfree(bt));
+      word_t *rest = bt_next(bt);
+      bt_make(rest, blocksize - asize, FREE);
+      word_t *next = bt_next(rest);
+      if (next && bt_free(next))
+        bt_make(rest, bt_size(rest) + bt_size(next), FREE);
+    }
+    return old_ptr;
+  }
+
+  /* Grow in place by absorbing a free right neighbor. */
+  word_t *next = bt_next(bt);
+  if (next && bt_free(next) && blocksize + bt_size(next) >= asize) {
+    size_t withnext = blocksize + bt_size(next);
+    if (withnext - asize >= 16) {
+      bt_make(bt, asize, USED | bt_get_prevfree(bt));
+      bt_make(bt_next(bt), withnext - asize, FREE);
+    } else {
+      bt_make(bt, withnext, USED | bt_get_prevfree(bt));
+    }
+    return old_ptr;
+  }
+
+  /* Otherwise move the payload. */
+  void *new_ptr = implicit_malloc(size);
+  if (new_ptr == NULL)
+    return NULL;
+  size_t payload = blocksize - sizeof(word_t);
+  memcpy(new_ptr, old_ptr, size < payload ? size : payload);
+  implicit_free(old_ptr);
+  return new_ptr;
 }
 
 /* --=[ calloc ]=----------------------------------------------------------- */
 
-void *calloc(size_t nmemb, size_t size) {
+static void *implicit_calloc(size_t nmemb, size_t size) {
   size_t bytes = nmemb * size;
-  void *new_ptr = malloc(bytes);
+  void *new_ptr = implicit_malloc(bytes);
   if (new_ptr)
     memset(new_ptr, 0, bytes);
   return new_ptr;
@@ -162,5 +277,21 @@ void *calloc(size_t nmemb, size_t size) {
 
 /* --=[ mm_checkheap ]=----------------------------------------------------- */
 
-void mm_checkheap(int verbose) {
+static void implicit_checkheap(int verbose __unused) {
+  for (word_t *bt = heap_start; bt < heap_end; bt = bt_next(bt)) {
+    msg("Block: %p Size: %d Used: %d \n", bt, bt_size(bt), bt_used(bt));
+    assert(bt_size(bt) > 0);
+  }
 }
+
+/* --=[ registry record ]=--------------------------------------------------- */
+
+const allocator_t allocator_implicit = {
+  .name = "implicit",
+  .init = implicit_init,
+  .malloc = implicit_malloc,
+  .free = implicit_free,
+  .realloc = implicit_realloc,
+  .calloc = implicit_calloc,
+  .checkheap = implicit_checkheap,
+};
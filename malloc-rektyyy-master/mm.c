@@ -1,12 +1,19 @@
 #include <assert.h>
+#include <errno.h>
+#include <immintrin.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef THREADED
+#include <pthread.h>
+#endif
+
 #include "mm.h"
 #include "memlib.h"
 
@@ -31,6 +38,8 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
 #endif /* !DRIVER */
 
 typedef int32_t word_t; /* Heap is bascially an array of 4-byte words. */
@@ -39,18 +48,239 @@ typedef enum {
   FREE = 0,     /* Block is free */
   USED = 1,     /* Block is used */
   PREVFREE = 2, /* Previous block is free (optimized boundary tags) */
+  GROWN = 4,    /* Block has been realloc-grown before (see realloc) */
 } bt_flags;
 
+/* Number of segregated free list size classes. Class i keeps free blocks
+ * of size [16 << i, 16 << (i + 1)), the last class keeps everything bigger. */
+#define NUM_CLASSES 24
+_Static_assert(NUM_CLASSES == MM_NUM_CLASSES, "mm.h class count out of sync");
+
+/* Minimum block size, which is also the split threshold: carving a
+ * remainder smaller than this off a fit would leave a block that cannot
+ * be freed. Two independent bounds meet at 16: a free block must hold
+ * its header, both compressed list links and the footer (four words,
+ * see ptr_size/ptr_address), and block sizes must stay multiples of
+ * ALIGNMENT or every successor payload comes off the alignment grid. */
+#define MIN_BLOCK 16
+_Static_assert(MIN_BLOCK >= 4 * sizeof(word_t),
+               "a free block must hold header, links and footer");
+_Static_assert(MIN_BLOCK % ALIGNMENT == 0,
+               "block sizes must keep payloads ALIGNMENT-aligned");
+
+/* Slots of the statistics area kept in the heap header, one uint64_t
+ * each (see struct mm_stats_out; free_blocks is computed on demand). */
+enum {
+  STAT_MALLOC = 0,
+  STAT_FREE,
+  STAT_REALLOC,
+  STAT_BYTES,
+  STAT_MERGES,
+  STAT_HIST, /* MM_FIT_HIST consecutive slots */
+  STAT_SLOTS = STAT_HIST + MM_FIT_HIST,
+};
+/* Words the stats area takes in the heap header, padded so the prologue
+ * after it keeps payloads 16-aligned. */
+#define STAT_WORDS 28
+
+/* Free blocks of at least this size are kept in a size-ordered treap
+ * instead of the class lists, so best-fit on them is a logarithmic
+ * descent rather than a list walk. */
+#define TREE_THRESHOLD 512
+
+/* Deferred coalescing mode (build with -DDEFERRED_COALESCE=1): free()
+ * parks blocks on a quarantine list untouched and the boundary-tag and
+ * list work happens in batches, when the quarantine fills up or when
+ * find_fit comes up empty. Good for workloads that free in bursts and
+ * reallocate the same sizes right away. */
+#ifndef DEFERRED_COALESCE
+#define DEFERRED_COALESCE 0
+#endif
+#define QUARANTINE_LIMIT 64
+
+/* Heap growth is amortized: morecore extends by at least CHUNKSIZE and
+ * the unused tail goes straight into the free lists, so a stream of
+ * fresh allocations does one sbrk per chunk instead of one per call. */
+#define CHUNKSIZE 4096
+
+/* A free block at the heap top whose size reaches this threshold has the
+ * interior of its pages handed back to the OS via mem_decommit. */
+#define DECOMMIT_THRESHOLD (128 * 1024)
+
+/* Slab mode (build with -DMM_SLAB=1): requests up to SLAB_MAX bytes are
+ * served from runs, page-sized carves dedicated to one object stride with
+ * an occupancy bitmap in front and no per-object metadata at all, so the
+ * 24/32/48-byte nodes that dominate many workloads cost their stride
+ * instead of a headered minimum block. The price is a partially filled
+ * page per active stride, which is why this is a specialization and not
+ * the default. Single-arena only: a slab hit in the threaded build would
+ * have to take the arena lock, which is exactly what the tcache avoids. */
+#ifndef MM_SLAB
+#define MM_SLAB 0
+#endif
+#if MM_SLAB && defined(THREADED)
+#error "the slab layer is single-arena; the threaded build keeps the tcache"
+#endif
+#define SLAB_MAX 48    /* largest request served from a run */
+#define SLAB_RUN 4096  /* run size; runs are SLAB_RUN-aligned */
+#define SLAB_HDR 64    /* bytes reserved for the run header */
+#define SLAB_CLASSES (SLAB_MAX / 16)
+#if MM_SLAB
+/* Heap-header words for the run list heads and the page bitmap. */
+#define SLAB_WORDS (4 + MAX_HEAP / SLAB_RUN / 32)
+#else
+#define SLAB_WORDS 0
+#endif
+
+/* Fit policy. Each policy is a separate compile-time specialization of
+ * find_fit (see the mm-first/next/good objects in the Makefile), so the
+ * hot loop carries no policy branches:
+ *   -DMM_FIT_FIRST   first block in the class list that fits
+ *   -DMM_FIT_NEXT    first fit resuming from a rover that survives calls
+ *   -DMM_FIT_GOOD=n  best fit that settles for a block within n percent
+ *                    of the request
+ * The default (no macro) is exhaustive best fit within the class. */
+
+#ifdef THREADED
+
+/* Number of arenas memlib's region is partitioned into. Threads are
+ * assigned to arenas round-robin, so with more threads than arenas an
+ * arena may be shared (and is protected by its lock). */
+#define NUM_ARENAS 8
+#define ARENA_SIZE (MAX_HEAP / NUM_ARENAS)
+
+typedef struct arena {
+  word_t *heap_start; /* Address of the first block */
+  word_t *heap_end;   /* Address past last byte of last block */
+  word_t *last;       /* Points at last block */
+  word_t *buckets;    /* Array of free list heads, one per size class */
+  word_t *tree_root;  /* Root of the large-block treap */
+  uint32_t nonempty;  /* Bit i is set iff buckets[i] is nonempty */
+  uint32_t prio_state;      /* xorshift32 state for treap priorities */
+  void *brk;                /* Arena's morecore cursor within its slice */
+  void *limit;              /* End of the arena's slice */
+  pthread_mutex_t lock;     /* Protects everything above */
+  word_t remote;            /* MPSC stack of blocks freed by other threads:
+                             * compressed offset of the first block, next
+                             * offsets in the blocks' payloads, 0 = empty.
+                             * Pushed with CAS, drained under the lock. */
+  word_t quarantine;        /* Deferred-coalescing list, 0 = empty */
+  uint32_t quarcount;       /* Number of quarantined blocks */
+  uint64_t *statv;          /* STAT_SLOTS counters in the heap header */
+#ifdef MM_FIT_NEXT
+  word_t rov;               /* Next-fit rover, offset of the block the
+                             * next search resumes at (0 = none) */
+#endif
+} arena_t;
+
+static arena_t arenas[NUM_ARENAS];
+static void *arena_base;         /* Start of the partitioned region */
+static int arena_next;           /* Round-robin thread assignment */
+static __thread arena_t *home;   /* Arena this thread allocates from */
+static __thread arena_t *cur;    /* Arena the current operation works on */
+
+/* Thread-local cache of small blocks. Cached blocks stay marked USED, so
+ * the hot malloc/free path touches no boundary tags, no free lists and no
+ * locks; they are carved from the arena TCACHE_BATCH at a time and given
+ * back half a bin at a time once a bin reaches TCACHE_LIMIT. */
+#define TCACHE_MAX 256 /* largest cached block size */
+#define TCACHE_BINS (TCACHE_MAX / 16)
+#define TCACHE_LIMIT 32 /* per-bin watermark triggering a flush */
+#define TCACHE_BATCH 8  /* blocks carved from the arena per refill */
+
+typedef struct {
+  word_t head[TCACHE_BINS]; /* compressed offsets, 0 = empty bin */
+  uint32_t count[TCACHE_BINS];
+} tcache_t;
+
+static __thread tcache_t tcache;
+
+/* The allocator body below is written against the single-arena globals;
+ * in threaded mode they resolve to the fields of the current arena. */
+#define heap_start (cur->heap_start)
+#define heap_end (cur->heap_end)
+#define last (cur->last)
+#define buckets (cur->buckets)
+#define tree_root (cur->tree_root)
+#define nonempty (cur->nonempty)
+#define prio_state (cur->prio_state)
+#define quarantine (cur->quarantine)
+#define quarcount (cur->quarcount)
+#define stats (cur->statv)
+#ifdef MM_FIT_NEXT
+#define rover (cur->rov)
+#endif
+
+/* Returns the arena this thread allocates from, picking one on first use. */
+static arena_t *arena_self(void) {
+  if (!home)
+    home =
+      &arenas[__atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED) %
+              NUM_ARENAS];
+  return home;
+}
+
+/* Returns the arena owning given heap address. */
+static arena_t *arena_of(void *ptr) {
+  return &arenas[((char *)ptr - (char *)arena_base) / ARENA_SIZE];
+}
+
+#else /* !THREADED */
+
 static word_t *heap_start; /* Address of the first block */
 static word_t *heap_end;   /* Address past last byte of last block */
 static word_t *last;       /* Points at last block */
-static word_t *list_start; /* Address of first free block*/
-static word_t *list_end;   /* Address of last free block*/
+static word_t *buckets;    /* Array of free list heads, one per size class.
+                            * Kept in the heap header, stored as compressed
+                            * offsets (see ptr_size), 0 means empty class. */
+static uint32_t nonempty;  /* Bit i is set iff buckets[i] is nonempty. */
+static word_t *tree_root;  /* Root of the large-block treap. */
+static uint32_t prio_state; /* xorshift32 state for treap priorities. */
+static word_t quarantine;  /* Deferred-coalescing list, 0 = empty. */
+static uint32_t quarcount; /* Number of quarantined blocks. */
+static word_t *virgin;     /* Highest heap_end ever reached in this process.
+                            * Memory above it was never written and still
+                            * reads as the zeroes mmap handed out, which
+                            * calloc exploits. Deliberately not reset by
+                            * mm_init: the driver reuses the heap area. */
+static uint64_t *stats;    /* STAT_SLOTS counters, kept in the heap header
+                            * like buckets (no mutable global arrays). */
+#ifdef MM_FIT_NEXT
+static word_t rover;       /* Next-fit rover, offset of the block the next
+                            * search resumes at (0 = none). */
+#endif
+#if MM_SLAB
+static word_t *slabs;      /* Heads of the partial-run lists, one per
+                            * stride, compressed offsets like buckets. */
+static uint32_t *slabmap;  /* Bit per heap page, set iff it is a slab run;
+                            * how free() tells headerless slab objects
+                            * from ordinary blocks. */
+#endif
+
+#endif /* !THREADED */
+
+/* Hot-path counter bump; a plain increment, or a relaxed atomic when
+ * arenas share counters. Deltas may be negative (mod 2^64). */
+static inline void stat_add(int slot, uint64_t n) {
+#ifdef THREADED
+  __atomic_fetch_add(&stats[slot], n, __ATOMIC_RELAXED);
+#else
+  stats[slot] += n;
+#endif
+}
+
+/* Bucket a find_fit scan length into the log2 histogram. */
+static inline void stat_scan(uint64_t scanned) {
+  int bucket = scanned ? 64 - __builtin_clzl(scanned) : 0;
+  if (bucket >= MM_FIT_HIST)
+    bucket = MM_FIT_HIST - 1;
+  stat_add(STAT_HIST + bucket, 1);
+}
 
 /* --=[ boundary tag handling ]=-------------------------------------------- */
 
 static inline word_t bt_size(word_t *bt) {
-  return *bt & ~(USED | PREVFREE);
+  return *bt & ~(USED | PREVFREE | GROWN);
 }
 
 static inline int bt_used(word_t *bt) {
@@ -85,6 +315,13 @@ static inline void bt_set_prevfree(word_t *bt) {
   *bt |= PREVFREE;
 }
 
+/* Growth history flag: set on a block realloc has grown once, so the next
+ * growth over-allocates. Cleared implicitly whenever bt_make rebuilds the
+ * header (free, reuse from the free lists). */
+static inline bt_flags bt_get_grown(word_t *bt) {
+  return *bt & GROWN;
+}
+
 /* Returns address of payload. */
 static inline void *bt_payload(word_t *bt) {
   return bt + 1;
@@ -157,47 +394,178 @@ static void list_clr_next(word_t *block) {
   *(block + 1) = (unsigned long)NULL;
 }
 
-/* Add free block to list */
+/* --=[ large block treap ]=------------------------------------------------ */
+
+/* Free blocks of TREE_THRESHOLD bytes and more form a treap ordered by
+ * (size, address) with random heap priorities. The node lives in the block's
+ * payload: left child at word 1, right child at word 2 (compressed offsets,
+ * like the list links) and the priority at word 3. Offset 0 means no child. */
+
+static word_t *tree_left(word_t *node) {
+  return ptr_address(*(node + 1));
+}
+
+static word_t *tree_right(word_t *node) {
+  return ptr_address(*(node + 2));
+}
+
+static void tree_set_left(word_t *node, word_t *val) {
+  *(node + 1) = ptr_size(val);
+}
+
+static void tree_set_right(word_t *node, word_t *val) {
+  *(node + 2) = ptr_size(val);
+}
+
+static word_t tree_prio(word_t *node) {
+  return *(node + 3);
+}
+
+/* xorshift32 generator for treap priorities */
+static word_t tree_prio_next(void) {
+  prio_state ^= prio_state << 13;
+  prio_state ^= prio_state >> 17;
+  prio_state ^= prio_state << 5;
+  return (word_t)prio_state;
+}
+
+/* Ordering key: size first, address breaks ties, so keys are unique. */
+static int tree_before(word_t *a, word_t *b) {
+  if (bt_size(a) != bt_size(b))
+    return bt_size(a) < bt_size(b);
+  return ptr_size(a) < ptr_size(b);
+}
+
+/* Split tree into blocks before node (*left) and after node (*right). */
+static void tree_split(word_t *tree, word_t *node, word_t **left,
+                       word_t **right) {
+  if (tree == ptr_address(0)) {
+    *left = *right = ptr_address(0);
+  } else if (tree_before(tree, node)) {
+    tree_split(tree_right(tree), node, left, right);
+    tree_set_right(tree, *left);
+    *left = tree;
+  } else {
+    tree_split(tree_left(tree), node, left, right);
+    tree_set_left(tree, *right);
+    *right = tree;
+  }
+}
+
+/* Join two trees; every key in left is before every key in right. */
+static word_t *tree_merge(word_t *left, word_t *right) {
+  if (left == ptr_address(0))
+    return right;
+  if (right == ptr_address(0))
+    return left;
+  if (tree_prio(left) > tree_prio(right)) {
+    tree_set_right(left, tree_merge(tree_right(left), right));
+    return left;
+  } else {
+    tree_set_left(right, tree_merge(left, tree_left(right)));
+    return right;
+  }
+}
+
+static word_t *tree_insert(word_t *tree, word_t *node) {
+  if (tree == ptr_address(0))
+    return node;
+  if (tree_prio(node) > tree_prio(tree)) {
+    word_t *left, *right;
+    tree_split(tree, node, &left, &right);
+    tree_set_left(node, left);
+    tree_set_right(node, right);
+    return node;
+  }
+  if (tree_before(node, tree))
+    tree_set_left(tree, tree_insert(tree_left(tree), node));
+  else
+    tree_set_right(tree, tree_insert(tree_right(tree), node));
+  return tree;
+}
+
+static word_t *tree_remove(word_t *tree, word_t *node) {
+  if (tree == node)
+    return tree_merge(tree_left(tree), tree_right(tree));
+  if (tree_before(node, tree))
+    tree_set_left(tree, tree_remove(tree_left(tree), node));
+  else
+    tree_set_right(tree, tree_remove(tree_right(tree), node));
+  return tree;
+}
+
+/* Best fit on the treap: descend towards the smallest block >= reqsz. */
+static word_t *tree_bestfit(size_t reqsz, uint64_t *scanned) {
+  word_t *best = NULL;
+  for (word_t *node = tree_root; node != ptr_address(0);) {
+    (*scanned)++;
+    if (bt_size(node) >= (word_t)reqsz) {
+      best = node;
+      node = tree_left(node);
+    } else {
+      node = tree_right(node);
+    }
+  }
+  return best;
+}
+
+/* Returns size class index for given block size */
+static int list_class(size_t size) {
+  /* Class i keeps [16 << i, 16 << (i + 1)), so the index is the position
+   * of the top set bit minus 4 (class 0 keeps 16..31 bytes). */
+  int class = 8 * sizeof(long) - 1 - __builtin_clzl(size) - 4;
+  if (class >= NUM_CLASSES)
+    class = NUM_CLASSES - 1;
+  return class;
+}
+
+/* Add free block to the list of its size class (or the large-block treap) */
 static void list_add(word_t *block) {
+  if (bt_size(block) >= TREE_THRESHOLD) {
+    tree_set_left(block, ptr_address(0));
+    tree_set_right(block, ptr_address(0));
+    *(block + 3) = tree_prio_next();
+    tree_root = tree_insert(tree_root, block);
+    return;
+  }
+  int class = list_class(bt_size(block));
   /* If list is empty */
-  if (list_start == NULL) {
-    list_start = block;
-    list_end = block;
-    list_clr_next(list_start);
-    list_clr_prev(list_end);
+  if (buckets[class] == 0) {
+    list_clr_next(block);
+    list_clr_prev(block);
   } else {
-    list_set_next(block, list_start);
-    list_set_prev(list_start, block);
+    word_t *head = ptr_address(buckets[class]);
+    list_set_next(block, head);
+    list_set_prev(head, block);
     list_clr_prev(block);
-    list_start = block;
   }
+  buckets[class] = ptr_size(block);
+  nonempty |= (uint32_t)1 << class;
 }
 
-/* Remove free block from list */
+/* Remove free block from the list of its size class (or the treap) */
 static void list_remove(word_t *block) {
-  /* The only block in the list */
-  if (list_start == block && list_end == block) {
-    list_start = NULL;
-    list_end = NULL;
+  if (bt_size(block) >= TREE_THRESHOLD) {
+    tree_root = tree_remove(tree_root, block);
+    return;
   }
+  int class = list_class(bt_size(block));
+  word_t *next = ptr_next(block);
+  word_t *prev = ptr_prev(block);
+#ifdef MM_FIT_NEXT
+  /* Never leave the rover dangling at a removed block. */
+  if (rover == ptr_size(block))
+    rover = (next == ptr_address(0)) ? 0 : ptr_size(next);
+#endif
   /* Remove block from the start */
-  else if (list_start == block) {
-    list_start = ptr_next(list_start);
-    list_clr_prev(list_start);
-
-  }
-  /* Remove block from the end*/
-  else if (list_end == block) {
-    list_end = ptr_prev(list_end);
-    list_clr_next(list_end);
-  }
-  /* Remove block from the middle */
-  else {
-    word_t *prev = ptr_prev(block);
-    word_t *next = ptr_next(block);
+  if (prev == ptr_address(0)) {
+    buckets[class] = (next == ptr_address(0)) ? 0 : ptr_size(next);
+    if (buckets[class] == 0)
+      nonempty &= ~((uint32_t)1 << class);
+  } else
     list_set_next(prev, next);
+  if (next != ptr_address(0))
     list_set_prev(next, prev);
-  }
 }
 
 /* --=[ miscellanous procedures ]=------------------------------------------ */
@@ -226,36 +594,199 @@ static inline size_t blksz(size_t size) {
   return round_up(size + sizeof(word_t));
 }
 
+/* Extends the heap; in threaded mode each arena bumps its own cursor
+ * within its slice of memlib's region instead of calling mem_sbrk. */
+static void *heap_sbrk(long incr) {
+#ifdef THREADED
+  if ((char *)cur->brk + incr > (char *)cur->limit)
+    return (void *)-1;
+  void *old_brk = cur->brk;
+  cur->brk = (char *)cur->brk + incr;
+  return old_brk;
+#else
+  return mem_sbrk(incr);
+#endif
+}
+
 /* Get more memory */
 static void *morecore(size_t size) {
-  void *ptr = mem_sbrk(size);
+  void *ptr = heap_sbrk(size);
+  if (ptr == (void *)-1)
+    return NULL;
   last = heap_end;
 
   word_t epilogue = *heap_end;
   heap_end = (void *)heap_end + size;
   *heap_end = epilogue;
-  if (ptr == (void *)-1)
-    return NULL;
+#ifndef THREADED
+  if (heap_end > virgin)
+    virgin = heap_end;
+#endif
   return last;
 }
 
+/* --=[ event ring ]=------------------------------------------------------- */
+
+/* The printf debug machinery above is unusable on a production hot path,
+ * so a latency spike used to leave no evidence. The event ring is an
+ * mmap-backed circular buffer of 16-byte records: once armed with
+ * mm_trace_start, every public entry point appends one record (rdtsc,
+ * requested size, op tag and the resulting payload as a compressed
+ * offset) with a handful of stores; while off it costs one predicted
+ * branch on a null pointer. mm_trace_dump formats the captured tail
+ * with async-signal-safe calls only, so it can run from a signal
+ * handler or an atexit hook. Batch entry points are not traced. */
+
+typedef struct {
+  uint64_t tsc;  /* timestamp counter when the call completed */
+  uint32_t size; /* requested bytes (0 for free) */
+  uint32_t info; /* compressed payload offset | op tag */
+} trace_rec_t;
+
+/* Op tags; payloads are 16-aligned, so the low offset bits are free. */
+enum { TR_MALLOC = 1, TR_FREE, TR_REALLOC, TR_MEMALIGN };
+
+static trace_rec_t *tring; /* NULL while tracing is off */
+static uint32_t tring_mask;
+static uint32_t tring_head;
+
+static void trace_event(int op, size_t size, void *ptr) {
+#ifdef THREADED
+  uint32_t slot = __atomic_fetch_add(&tring_head, 1, __ATOMIC_RELAXED);
+#else
+  uint32_t slot = tring_head++;
+#endif
+  trace_rec_t *rec = &tring[slot & tring_mask];
+  rec->tsc = __builtin_ia32_rdtsc();
+  rec->size = (uint32_t)size;
+  rec->info = (ptr ? (uint32_t)ptr_size(ptr) & ~15u : 0) | op;
+}
+
+#define trace_hook(op, size, ptr)                                              \
+  do {                                                                         \
+    if (__builtin_expect(tring != NULL, 0))                                    \
+      trace_event(op, size, ptr);                                              \
+  } while (0)
+
+int mm_trace_start(size_t records) {
+  if (tring != NULL)
+    return 0;
+  size_t cap = 1024;
+  while (cap < records)
+    cap *= 2;
+  void *buf = mmap(NULL, cap * sizeof(trace_rec_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    return -1;
+  tring_mask = cap - 1;
+  tring_head = 0;
+  /* Publish the buffer last: a hook that sees tring sees a ready ring. */
+  __atomic_store_n(&tring, buf, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Unsigned decimal formatter; snprintf is not async-signal-safe. */
+static char *trace_fmt(char *p, uint64_t v) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n > 0)
+    *p++ = tmp[--n];
+  return p;
+}
+
+void mm_trace_dump(int fd) {
+  trace_rec_t *ring = __atomic_load_n(&tring, __ATOMIC_ACQUIRE);
+  if (ring == NULL)
+    return;
+  uint32_t head = tring_head;
+  uint32_t count = head > tring_mask ? tring_mask + 1 : head;
+  for (uint32_t i = head - count; i != head; i++) {
+    trace_rec_t *rec = &ring[i & tring_mask];
+    char line[64], *p = line;
+    p = trace_fmt(p, rec->tsc);
+    *p++ = ' ';
+    *p++ = "?afrm"[rec->info & 15];
+    *p++ = ' ';
+    p = trace_fmt(p, rec->size);
+    *p++ = ' ';
+    p = trace_fmt(p, rec->info & ~15u);
+    *p++ = '\n';
+    if (write(fd, line, p - line) < 0)
+      return;
+  }
+}
+
 /* --=[ mm_init ]=---------------------------------------------------------- */
 
-int mm_init(void) {
-  void *ptr = mem_sbrk(8 * sizeof(word_t));
-  if (!ptr)
+/* Sets up one heap (the only one, or the current arena's slice). */
+static int arena_init(void) {
+  /* Heap header: NUM_CLASSES words of free list heads and the statistics
+   * counters (kept on the heap so the allocator has no mutable global
+   * arrays), then the prologue block. */
+  void *ptr =
+    heap_sbrk((NUM_CLASSES + STAT_WORDS + SLAB_WORDS + 8) * sizeof(word_t));
+  if (!ptr || ptr == (void *)-1)
     return -1;
 
+  buckets = ptr;
+  for (int class = 0; class < NUM_CLASSES; class++)
+    buckets[class] = 0;
+  nonempty = 0;
+  tree_root = ptr_address(0);
+  prio_state = 2463534242; /* any nonzero xorshift32 seed */
+  quarantine = 0;
+  quarcount = 0;
+#ifdef MM_FIT_NEXT
+  rover = 0;
+#endif
+  stats = (uint64_t *)(buckets + NUM_CLASSES);
+  memset(stats, 0, STAT_SLOTS * sizeof(uint64_t));
+#if MM_SLAB
+  slabs = buckets + NUM_CLASSES + STAT_WORDS;
+  slabmap = (uint32_t *)(slabs + 4);
+  memset(slabs, 0, SLAB_WORDS * sizeof(word_t));
+#endif
+
+  ptr += (NUM_CLASSES + STAT_WORDS + SLAB_WORDS) * sizeof(word_t);
   bt_make(ptr + 3 * sizeof(word_t), 16, USED);
   heap_start = ptr + 7 * sizeof(word_t);
   heap_end = ptr + 7 * sizeof(word_t);
   *heap_end = (word_t)USED;
-  list_start = NULL;
-  list_end = NULL;
 
   last = NULL;
   return 0;
 }
+
+int mm_init(void) {
+#ifdef THREADED
+  /* Carve the whole memlib region at once and partition it into arenas,
+   * each with its own morecore cursor and free lists. */
+  void *base = mem_sbrk((long)NUM_ARENAS * ARENA_SIZE);
+  if (base == (void *)-1)
+    return -1;
+  arena_base = base;
+  arena_next = 0;
+  /* The heap is reset, so this thread's cached blocks are gone too. */
+  memset(&tcache, 0, sizeof(tcache));
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    arenas[i].brk = (char *)base + (long)i * ARENA_SIZE;
+    arenas[i].limit = (char *)arenas[i].brk + ARENA_SIZE;
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    arenas[i].remote = 0;
+    cur = &arenas[i];
+    if (arena_init() < 0)
+      return -1;
+  }
+  return 0;
+#else
+  return arena_init();
+#endif
+}
+
 /* --=[ coalesce ]=--------------------------------------------------------- */
 
 /* Join free blocks */
@@ -274,6 +805,7 @@ static void *coalesce(void *bt) {
     list_remove(next);
     bt_make(bt, bt_size(bt) + bt_size(next), FREE);
     list_add(bt);
+    stat_add(STAT_MERGES, 1);
     return bt;
   }
   /* Block on the left is free */
@@ -281,6 +813,7 @@ static void *coalesce(void *bt) {
     list_remove(prev);
     bt_make(prev, bt_size(prev) + bt_size(bt), FREE);
     list_add(prev);
+    stat_add(STAT_MERGES, 1);
     return prev;
   }
   /* Blocks on the right and left are free */
@@ -289,109 +822,737 @@ static void *coalesce(void *bt) {
     bt_make(prev, bt_size(prev) + bt_size(bt) + bt_size(next), FREE);
     list_add(prev);
     list_remove(next);
+    stat_add(STAT_MERGES, 2);
     return prev;
   }
 }
 
+#if DEFERRED_COALESCE
+/* Walk the quarantine once, giving every parked block the boundary-tag
+ * and coalesce treatment free() skipped. Two quarantined neighbors merge
+ * once both have been walked, since coalesce runs on each in turn. */
+static void quarantine_flush(void) {
+  word_t off = quarantine;
+  quarantine = 0;
+  quarcount = 0;
+  while (off != 0) {
+    word_t *block = ptr_address(off);
+    off = *(block + 1);
+    bt_make(block, bt_size(block), FREE | bt_get_prevfree(block));
+    coalesce(block);
+  }
+}
+#endif /* DEFERRED_COALESCE */
+
+#if MM_SLAB
+
+/* --=[ slab runs ]=-------------------------------------------------------- */
+
+static word_t *find_fit(size_t reqsz);
+static void *malloc_internal(size_t size);
+
+/* A run sits inside an ordinary USED block of SLAB_RUN bytes, so heap
+ * walks and coalescing see it as one opaque allocation; the run header
+ * below occupies the first SLAB_HDR bytes of its payload and the objects
+ * are packed behind it at their bare stride. The block is placed so the
+ * header lands exactly on a page boundary, which is what lets free()
+ * recover it from an object pointer by masking. */
+typedef struct {
+  word_t next;        /* Links of the class's partial-run list, compressed
+                       * offsets, 0 = end of list. */
+  word_t prev;
+  word_t class;       /* Stride class index, stride = 16 * (class + 1). */
+  uint32_t inuse;     /* Number of allocated objects in this run. */
+  uint64_t bitmap[4]; /* Bit i set iff object i is allocated. */
+} slab_run_t;
+
+_Static_assert(sizeof(slab_run_t) <= SLAB_HDR, "run header overflows");
+
+static inline size_t slab_stride(int class) {
+  return 16 * (class + 1);
+}
+
+/* Objects per run: the header and the next block's boundary tag are the
+ * only space a run does not hand out. */
+static inline size_t slab_cap(size_t stride) {
+  return (SLAB_RUN - SLAB_HDR - sizeof(word_t)) / stride;
+}
+
+/* Is ptr an object in some run? Cheap enough to ask on every free(). */
+static inline int slab_owns(void *ptr) {
+  size_t page = ((uintptr_t)ptr - 0x800000000) / SLAB_RUN;
+  return (slabmap[page / 32] >> (page % 32)) & 1;
+}
+
+static void slab_list_add(slab_run_t *run) {
+  run->prev = 0;
+  run->next = slabs[run->class];
+  if (run->next)
+    ((slab_run_t *)ptr_address(run->next))->prev = ptr_size((word_t *)run);
+  slabs[run->class] = ptr_size((word_t *)run);
+}
+
+static void slab_list_remove(slab_run_t *run) {
+  if (run->prev)
+    ((slab_run_t *)ptr_address(run->prev))->next = run->next;
+  else
+    slabs[run->class] = run->next;
+  if (run->next)
+    ((slab_run_t *)ptr_address(run->next))->prev = run->prev;
+}
+
+/* Creates a run for given class: finds room for a page-aligned USED
+ * block of SLAB_RUN bytes (recycling a free block when one is big enough
+ * to hold an aligned page, else at the heap top) and splits the slack
+ * off both ends back into the lists. */
+static slab_run_t *slab_run_new(int class) {
+  word_t *block;
+  /* A block of 2 * SLAB_RUN - ALIGNMENT bytes holds an aligned page wherever
+   * the page boundary falls within it. */
+  word_t *fit = find_fit(2 * SLAB_RUN - ALIGNMENT);
+  if (fit) {
+    list_remove(fit);
+    size_t size = bt_size(fit);
+    uintptr_t page =
+      ((uintptr_t)fit + sizeof(word_t) + SLAB_RUN - 1) & -(uintptr_t)SLAB_RUN;
+    size_t prefix = page - sizeof(word_t) - (uintptr_t)fit;
+    size_t suffix = size - prefix - SLAB_RUN;
+    word_t prevfree = bt_get_prevfree(fit);
+    block = (word_t *)(page - sizeof(word_t));
+    bt_make(block, SLAB_RUN, USED | (prefix ? PREVFREE : prevfree));
+    if (prefix) {
+      bt_make(fit, prefix, FREE | prevfree);
+      list_add(fit);
+    }
+    if (suffix) {
+      word_t *rest = bt_next(block);
+      bt_make(rest, suffix, FREE);
+      list_add(rest);
+    }
+  } else {
+    uintptr_t page = ((uintptr_t)heap_end + sizeof(word_t) + SLAB_RUN - 1) &
+                     -(uintptr_t)SLAB_RUN;
+    size_t gap = page - sizeof(word_t) - (uintptr_t)heap_end;
+    word_t *base = morecore(gap + SLAB_RUN);
+    if (!base)
+      return NULL;
+    /* Like malloc's extension path, the old epilogue still sits at base
+     * and carries the PREVFREE bit of the old last block. */
+    word_t prevfree = bt_get_prevfree(base);
+    block = (word_t *)(page - sizeof(word_t));
+    bt_make(block, SLAB_RUN, USED | (gap ? PREVFREE : prevfree));
+    if (gap) {
+      bt_make(base, gap, FREE | prevfree);
+      coalesce(base);
+    }
+  }
+
+  slab_run_t *run = bt_payload(block);
+  memset(run, 0, sizeof(*run));
+  run->class = class;
+  size_t page = ((uintptr_t)run - 0x800000000) / SLAB_RUN;
+  slabmap[page / 32] |= (uint32_t)1 << (page % 32);
+  slab_list_add(run);
+  return run;
+}
+
+/* Serves one object of at most SLAB_MAX bytes, or NULL if no run can be
+ * made (the caller then falls back to the lists). */
+static void *slab_malloc(size_t size) {
+  int class = round_up(size) / 16 - 1;
+  slab_run_t *run = slabs[class] ? (slab_run_t *)ptr_address(slabs[class])
+                                 : slab_run_new(class);
+  if (!run)
+    return NULL;
+  size_t stride = slab_stride(class);
+  size_t i = 0;
+  /* A run on the partial list always has a clear bit below its capacity,
+   * and bits above it are never set. */
+  for (int w = 0; w < 4; w++) {
+    uint64_t freebits = ~run->bitmap[w];
+    if (!freebits)
+      continue;
+    i = w * 64 + __builtin_ctzl(freebits);
+    run->bitmap[w] |= freebits & -freebits;
+    break;
+  }
+  if (++run->inuse == slab_cap(stride))
+    slab_list_remove(run);
+  stat_add(STAT_BYTES, stride);
+  return (void *)((uintptr_t)run + SLAB_HDR + i * stride);
+}
+
+static void slab_free(void *ptr) {
+  slab_run_t *run = (slab_run_t *)((uintptr_t)ptr & -(uintptr_t)SLAB_RUN);
+  size_t stride = slab_stride(run->class);
+  size_t i = ((uintptr_t)ptr - (uintptr_t)run - SLAB_HDR) / stride;
+  run->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+  stat_add(STAT_BYTES, -(uint64_t)stride);
+  if (run->inuse-- == slab_cap(stride))
+    slab_list_add(run); /* was full, has room again */
+  if (run->inuse > 0)
+    return;
+  /* The run is empty. Keep the class's last run as a cache against
+   * alloc/free flutter at the page boundary; release any other. */
+  if (slabs[run->class] == ptr_size((word_t *)run) && run->next == 0)
+    return;
+  slab_list_remove(run);
+  size_t page = ((uintptr_t)run - 0x800000000) / SLAB_RUN;
+  slabmap[page / 32] &= ~((uint32_t)1 << (page % 32));
+  word_t *block = bt_fromptr(run);
+  bt_make(block, bt_size(block), FREE | bt_get_prevfree(block));
+  coalesce(block);
+}
+
+/* Resizing a slab object: shrinks stay put, anything past the stride
+ * moves (objects cannot grow in place). */
+static void *slab_realloc(void *old_ptr, size_t size) {
+  slab_run_t *run = (slab_run_t *)((uintptr_t)old_ptr & -(uintptr_t)SLAB_RUN);
+  size_t stride = slab_stride(run->class);
+  if (size <= stride)
+    return old_ptr;
+  void *new_ptr = size <= SLAB_MAX ? slab_malloc(size) : NULL;
+  if (!new_ptr)
+    new_ptr = malloc_internal(size);
+  if (!new_ptr)
+    return NULL;
+  memcpy(new_ptr, old_ptr, stride);
+  slab_free(old_ptr);
+  return new_ptr;
+}
+
+#endif /* MM_SLAB */
+
 /* --=[ malloc ]=----------------------------------------------------------- */
 
-#if 0
+static void free_internal(void *ptr);
+
+#ifdef THREADED
+
+/* Push block onto a foreign arena's remote-free stack: one CAS, no lock. */
+static void arena_remote_free(arena_t *arena, word_t *block) {
+  word_t head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+  do {
+    *(block + 1) = head;
+  } while (!__atomic_compare_exchange_n(&arena->remote, &head,
+                                        ptr_size(block), 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+/* Drain the remote-free stack into the arena's free lists. Called with the
+ * arena lock held, so this thread is the only consumer. */
+static void arena_drain_remote(arena_t *arena) {
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == 0)
+    return;
+  word_t head = __atomic_exchange_n(&arena->remote, 0, __ATOMIC_ACQUIRE);
+  while (head != 0) {
+    word_t *block = ptr_address(head);
+    /* Read the next offset before free_internal reuses the payload word. */
+    head = *(block + 1);
+    free_internal(bt_payload(block));
+  }
+}
+
+#endif /* THREADED */
+
+#if defined(MM_FIT_FIRST)
 /* First fit startegy. */
-static word_t *find_fit(size_t reqsz) { 
-  if (!list_start)
-    return NULL;
-  for (word_t *ptr = list_start; ptr != (word_t *)0x800000000; ptr = ptr_next(ptr)) {
-    if (bt_size(ptr) >= reqsz) {
-      return ptr;
+static word_t *find_fit(size_t reqsz) {
+  uint32_t mask = nonempty & (~(uint32_t)0 << list_class(reqsz));
+  uint64_t scanned = 0;
+  while (mask) {
+    int class = __builtin_ctz(mask);
+    for (word_t *ptr = ptr_address(buckets[class]); ptr != ptr_address(0);
+         ptr = ptr_next(ptr)) {
+      scanned++;
+      if (bt_size(ptr) >= reqsz) {
+        stat_scan(scanned);
+        return ptr;
+      }
     }
+    mask &= mask - 1;
+  }
+  word_t *best = tree_bestfit(reqsz, &scanned);
+  stat_scan(scanned);
+  return best;
+}
+#elif defined(MM_FIT_NEXT)
+/* Scans one list segment for the first fitting block. */
+static word_t *list_scan(word_t *ptr, word_t *stop, size_t reqsz,
+                         uint64_t *scanned) {
+  for (; ptr != stop && ptr != ptr_address(0); ptr = ptr_next(ptr)) {
+    (*scanned)++;
+    if (bt_size(ptr) >= (word_t)reqsz)
+      return ptr;
   }
   return NULL;
 }
+
+/* Next fit startegy: first fit that resumes where the previous search
+ * stopped, so a run of similar requests does not rescan the same
+ * too-small blocks at the head of a class over and over. The rover is
+ * kept valid by list_remove. */
+static word_t *find_fit(size_t reqsz) {
+  uint32_t mask = nonempty & (~(uint32_t)0 << list_class(reqsz));
+  uint64_t scanned = 0;
+  int rclass = rover ? list_class(bt_size(ptr_address(rover))) : -1;
+  while (mask) {
+    int class = __builtin_ctz(mask);
+    word_t *found;
+    if (class == rclass) {
+      word_t *start = ptr_address(rover);
+      found = list_scan(start, ptr_address(0), reqsz, &scanned);
+      if (!found) /* wrap around to the head */
+        found = list_scan(ptr_address(buckets[class]), start, reqsz, &scanned);
+    } else {
+      found = list_scan(ptr_address(buckets[class]), ptr_address(0), reqsz,
+                        &scanned);
+    }
+    if (found) {
+      word_t *succ = ptr_next(found);
+      rover = (succ == ptr_address(0)) ? 0 : ptr_size(succ);
+      stat_scan(scanned);
+      return found;
+    }
+    mask &= mask - 1;
+  }
+  word_t *best = tree_bestfit(reqsz, &scanned);
+  stat_scan(scanned);
+  return best;
+}
+#elif defined(MM_FIT_GOOD)
+/* Good-enough fit startegy: best fit that settles for the first block
+ * within MM_FIT_GOOD percent of the request, trading a bounded amount of
+ * fragmentation for shorter scans. */
+static word_t *find_fit(size_t reqsz) {
+  size_t good = reqsz + reqsz * MM_FIT_GOOD / 100;
+  uint32_t mask = nonempty & (~(uint32_t)0 << list_class(reqsz));
+  uint64_t scanned = 0;
+  while (mask) {
+    int class = __builtin_ctz(mask);
+    word_t *best = NULL;
+    word_t bestsize = 0;
+    for (word_t *ptr = ptr_address(buckets[class]); ptr != ptr_address(0);
+         ptr = ptr_next(ptr)) {
+      scanned++;
+      word_t ptrsize = bt_size(ptr);
+      if (ptrsize >= reqsz) {
+        if ((size_t)ptrsize <= good) {
+          stat_scan(scanned);
+          return ptr;
+        }
+        if (!best || ptrsize < bestsize) {
+          best = ptr;
+          bestsize = ptrsize;
+        }
+      }
+    }
+    if (best) {
+      stat_scan(scanned);
+      return best;
+    }
+    mask &= mask - 1;
+  }
+  word_t *best = tree_bestfit(reqsz, &scanned);
+  stat_scan(scanned);
+  return best;
+}
 #else
-/* Best fit startegy. */
+/* Best fit startegy. The nonempty bitmap and ctz jump straight to the
+ * smallest class that may hold a fitting block, skipping empty classes;
+ * the first class that yields a fit ends the search, since every block
+ * in the classes above is at least as big. The scan touches one cache
+ * line per node (blocks are 16-aligned, so the header and both links
+ * share a line) and keeps the best size in a register rather than
+ * re-reading the best candidate's header on every comparison. */
 static word_t *find_fit(size_t reqsz) {
-  if (!list_start)
-    return NULL;
-  word_t *best = NULL;
-  for (word_t *ptr = list_start; ptr != (word_t *)0x800000000;
-       ptr = ptr_next(ptr)) {
-    word_t ptrsize = bt_size(ptr);
-    if (ptrsize >= reqsz) {
-      if (!best || ptrsize < bt_size(best)) {
-        best = ptr;
+  uint32_t mask = nonempty & (~(uint32_t)0 << list_class(reqsz));
+  uint64_t scanned = 0;
+  while (mask) {
+    int class = __builtin_ctz(mask);
+    word_t *best = NULL;
+    word_t bestsize = 0;
+    for (word_t *ptr = ptr_address(buckets[class]); ptr != ptr_address(0);
+         ptr = ptr_next(ptr)) {
+      scanned++;
+      word_t ptrsize = bt_size(ptr);
+      if (ptrsize >= reqsz) {
+        if (!best || ptrsize < bestsize) {
+          best = ptr;
+          bestsize = ptrsize;
+        }
       }
     }
+    if (best) {
+      stat_scan(scanned);
+      return best;
+    }
+    mask &= mask - 1;
   }
+  word_t *best = tree_bestfit(reqsz, &scanned);
+  stat_scan(scanned);
   return best;
 }
 #endif
 
-void *malloc(size_t size) {
+static void *malloc_internal(size_t size) {
   size_t asize = blksz(size);
   word_t *ptr = find_fit(asize);
+#if DEFERRED_COALESCE
+  if (!ptr && quarcount > 0) {
+    quarantine_flush();
+    ptr = find_fit(asize);
+  }
+#endif
   if (ptr) {
     size_t blksize = bt_size(ptr);
-    if (blksize - asize >= 16) {
+    /* Remove before bt_make rewrites the size its class is derived from. */
+    list_remove(ptr);
+    if (blksize - asize >= MIN_BLOCK) {
       bt_make(ptr, asize, USED | bt_get_prevfree(ptr));
       word_t *next = bt_next(ptr);
       bt_make(next, blksize - asize, FREE);
-      list_remove(ptr);
       coalesce(next);
     } else {
       bt_make(ptr, blksize, USED | bt_get_prevfree(ptr));
-      list_remove(ptr);
     }
   } else {
-    ptr = morecore(asize);
+    size_t extend = asize > CHUNKSIZE ? asize : CHUNKSIZE;
+    ptr = morecore(extend);
+    if (!ptr) {
+      /* No room for a whole chunk; retry with the exact size. */
+      extend = asize;
+      ptr = morecore(extend);
+      if (!ptr)
+        return NULL;
+    }
     bt_make(ptr, asize, USED | bt_get_prevfree(ptr));
+    if (extend > asize) {
+      word_t *next = bt_next(ptr);
+      bt_make(next, extend - asize, FREE);
+      coalesce(next);
+    }
   }
+  stat_add(STAT_BYTES, bt_size(ptr));
   return bt_payload(ptr);
 }
 
+#ifdef THREADED
+
+/* Each bin keeps blocks of one exact (aligned) size: 16, 32, ..., 256. */
+static int tcache_bin(size_t asize) {
+  return asize / 16 - 1;
+}
+
+/* Carve a batch of asize-blocks from this thread's arena in one locked
+ * pass and push them onto the bin. */
+static void tcache_refill(int bin, size_t asize) {
+  arena_t *arena = arena_self();
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  arena_drain_remote(arena);
+  for (int i = 0; i < TCACHE_BATCH; i++) {
+    void *ptr = malloc_internal(asize - sizeof(word_t));
+    if (!ptr) /* arena slice exhausted; the slow path will fall over */
+      break;
+    word_t *block = bt_fromptr(ptr);
+    *(block + 1) = tcache.head[bin];
+    tcache.head[bin] = ptr_size(block);
+    tcache.count[bin]++;
+  }
+  pthread_mutex_unlock(&arena->lock);
+}
+
+static void *tcache_alloc(size_t asize) {
+  int bin = tcache_bin(asize);
+  if (tcache.head[bin] == 0)
+    tcache_refill(bin, asize);
+  if (tcache.head[bin] == 0)
+    return NULL;
+  word_t *block = ptr_address(tcache.head[bin]);
+  tcache.head[bin] = *(block + 1);
+  tcache.count[bin]--;
+  return bt_payload(block);
+}
+
+/* Give everything past the first `keep` blocks of the bin back: blocks of
+ * this thread's arena in one locked batch, foreign ones via their owner's
+ * remote-free stack. */
+static void tcache_flush(int bin, uint32_t keep) {
+  word_t off = tcache.head[bin];
+  if (keep == 0) {
+    tcache.head[bin] = 0;
+  } else {
+    word_t *prev = NULL;
+    for (uint32_t i = 0; i < keep; i++) {
+      prev = ptr_address(off);
+      off = *(prev + 1);
+    }
+    *(prev + 1) = 0;
+  }
+  tcache.count[bin] = keep;
+
+  arena_t *mine = arena_self();
+  word_t local = 0;
+  while (off != 0) {
+    word_t *block = ptr_address(off);
+    off = *(block + 1);
+    arena_t *arena = arena_of(block);
+    if (arena == mine) {
+      *(block + 1) = local;
+      local = ptr_size(block);
+    } else {
+      arena_remote_free(arena, block);
+    }
+  }
+  if (local != 0) {
+    pthread_mutex_lock(&mine->lock);
+    cur = mine;
+    while (local != 0) {
+      word_t *block = ptr_address(local);
+      local = *(block + 1);
+      free_internal(bt_payload(block));
+    }
+    pthread_mutex_unlock(&mine->lock);
+  }
+}
+
+static void tcache_free(word_t *block) {
+  int bin = tcache_bin(bt_size(block));
+  *(block + 1) = tcache.head[bin];
+  tcache.head[bin] = ptr_size(block);
+  if (++tcache.count[bin] >= TCACHE_LIMIT)
+    tcache_flush(bin, TCACHE_LIMIT / 2);
+}
+
+#endif /* THREADED */
+
+static void *malloc_entry(size_t size) {
+#ifdef STANDALONE
+  mm_standalone_init();
+#endif
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_MALLOC], 1, __ATOMIC_RELAXED);
+  if (blksz(size) <= TCACHE_MAX) {
+    void *ptr = tcache_alloc(blksz(size));
+    if (ptr)
+      return ptr;
+  }
+  arena_t *arena = arena_self();
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  arena_drain_remote(arena);
+  void *ptr = malloc_internal(size);
+  pthread_mutex_unlock(&arena->lock);
+  if (ptr)
+    return ptr;
+  /* Home arena's slice is exhausted: borrow from the other arenas. */
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    arena = &arenas[i];
+    if (arena == home)
+      continue;
+    pthread_mutex_lock(&arena->lock);
+    cur = arena;
+    arena_drain_remote(arena);
+    ptr = malloc_internal(size);
+    pthread_mutex_unlock(&arena->lock);
+    if (ptr)
+      return ptr;
+  }
+  return NULL;
+#else
+  stat_add(STAT_MALLOC, 1);
+#if MM_SLAB
+  if (size > 0 && size <= SLAB_MAX) {
+    void *ptr = slab_malloc(size);
+    if (ptr)
+      return ptr;
+  }
+#endif
+  return malloc_internal(size);
+#endif
+}
+
+void *malloc(size_t size) {
+  void *ptr = malloc_entry(size);
+  trace_hook(TR_MALLOC, size, ptr);
+  return ptr;
+}
+
 /* --=[ free ]=------------------------------------------------------------- */
 
-void free(void *ptr) {
+static void free_internal(void *ptr) {
   if (ptr != NULL) {
     word_t *block = bt_fromptr(ptr);
+    stat_add(STAT_BYTES, -(uint64_t)bt_size(block));
+#if DEFERRED_COALESCE
+    /* Park the block untouched: header stays USED so neighbors keep out,
+     * the next link goes into the dead payload. */
+    *(block + 1) = quarantine;
+    quarantine = ptr_size(block);
+    if (++quarcount >= QUARANTINE_LIMIT)
+      quarantine_flush();
+#else
     bt_make(block, bt_size(block), FREE | bt_get_prevfree(block));
-    coalesce(block);
+    word_t *merged = coalesce(block);
+    /* A big free block at the heap top keeps its boundary tags and links
+     * but gives the pages in between back to the OS. */
+    if (bt_size(merged) >= DECOMMIT_THRESHOLD && bt_next(merged) == heap_end)
+      mem_decommit(merged + 4, bt_size(merged) - 5 * sizeof(word_t));
+#endif
   }
 }
 
-/* --=[ realloc ]=---------------------------------------------------------- */
+static void free_entry(void *ptr) {
+#ifdef STANDALONE
+  /* A preloaded allocator also sees pointers that predate it (ld.so,
+   * early libc); those are deliberately leaked. */
+  if (ptr != NULL && !mem_owns(ptr))
+    return;
+#endif
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_FREE], 1, __ATOMIC_RELAXED);
+  if (ptr == NULL)
+    return;
+  /* Small blocks go back to this thread's cache untouched. */
+  word_t *block = bt_fromptr(ptr);
+  if (bt_size(block) <= TCACHE_MAX) {
+    tcache_free(block);
+    return;
+  }
+  /* The block goes back to the arena it was carved from, which may not be
+   * this thread's arena. Foreign blocks are pushed onto the owner's
+   * remote-free stack instead of taking its lock; the owner drains the
+   * stack at the top of malloc. */
+  arena_t *arena = arena_of(ptr);
+  if (arena != home) {
+    arena_remote_free(arena, bt_fromptr(ptr));
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  free_internal(ptr);
+  pthread_mutex_unlock(&arena->lock);
+#else
+  stat_add(STAT_FREE, 1);
+#if MM_SLAB
+  if (ptr != NULL && slab_owns(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+  free_internal(ptr);
+#endif
+}
 
-void *realloc(void *old_ptr, size_t size) {
-  if (old_ptr == NULL)
-    return malloc(size);
-  if (size == 0) {
-    free(old_ptr);
-    return NULL;
+void free(void *ptr) {
+  free_entry(ptr);
+  trace_hook(TR_FREE, 0, ptr);
+}
+
+/* --=[ bulk copy/zero ]=--------------------------------------------------- */
+
+/* A block move above STREAM_THRESHOLD works on data that does not fit in
+ * L2, so pulling it through the cache with memcpy/memset evicts everything
+ * the caller still cares about. Above the threshold we switch to AVX2
+ * non-temporal stores, which write around the cache and skip the
+ * read-for-ownership of the destination lines. AVX2 is detected once at
+ * runtime (the check is idempotent, so the unsynchronized cache is fine
+ * under THREADED); everything else stays on plain memcpy/memset. */
+#define STREAM_THRESHOLD (256 * 1024)
+
+static int stream_avx2 = -1;
+
+__attribute__((target("avx2"))) static void stream_copy(void *dst,
+                                                        const void *src,
+                                                        size_t len) {
+  char *d = dst;
+  const char *s = src;
+  /* Payloads are only 16-aligned; streaming stores need 32. */
+  size_t head = -(uintptr_t)d & 31;
+  memcpy(d, s, head);
+  d += head, s += head, len -= head;
+  for (; len >= 32; d += 32, s += 32, len -= 32)
+    _mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+  /* Streaming stores are weakly ordered; fence before anyone reads them. */
+  _mm_sfence();
+  memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void stream_zero(void *dst,
+                                                        size_t len) {
+  char *d = dst;
+  size_t head = -(uintptr_t)d & 31;
+  memset(d, 0, head);
+  d += head, len -= head;
+  __m256i zero = _mm256_setzero_si256();
+  for (; len >= 32; d += 32, len -= 32)
+    _mm256_stream_si256((__m256i *)d, zero);
+  _mm_sfence();
+  memset(d, 0, len);
+}
+
+/* Both helpers require non-overlapping ranges, like memcpy. */
+static void bulk_copy(void *dst, const void *src, size_t len) {
+  if (len >= STREAM_THRESHOLD) {
+    if (stream_avx2 < 0)
+      stream_avx2 = __builtin_cpu_supports("avx2");
+    if (stream_avx2) {
+      stream_copy(dst, src, len);
+      return;
+    }
   }
+  memcpy(dst, src, len);
+}
 
+static void bulk_zero(void *dst, size_t len) {
+  if (len >= STREAM_THRESHOLD) {
+    if (stream_avx2 < 0)
+      stream_avx2 = __builtin_cpu_supports("avx2");
+    if (stream_avx2) {
+      stream_zero(dst, len);
+      return;
+    }
+  }
+  memset(dst, 0, len);
+}
+
+/* --=[ realloc ]=---------------------------------------------------------- */
+
+static void *realloc_internal(void *old_ptr, size_t size) {
   word_t *block = bt_fromptr(old_ptr);
   word_t blocksize = bt_size(block);
   word_t asize = blksz(size);
 
   /* jezeli nasz blok jest ma wiekszy size od wymaganego rozmiaru mozemy go
-   * zmniejszyc*/
+   * zmniejszyc. A grown block keeps its slack (that is what the slack is
+   * for) unless the caller shrinks it by more than half. */
   if (asize <= blocksize) {
     word_t rest = blocksize - asize;
-    if (rest >= 16) {
+    if (rest >= MIN_BLOCK && (!bt_get_grown(block) || rest > blocksize / 2)) {
       bt_make(block, asize, USED | bt_get_prevfree(block));
       bt_make(bt_next(block), rest, FREE);
       coalesce(bt_next(block));
+      stat_add(STAT_BYTES, (int64_t)asize - blocksize);
     }
     return old_ptr;
   }
 
   word_t *next = bt_next(block);
   /* jezeli nasz blok jest na samym koncu mozemy odrazu dac mu wiecej miejsca */
-  if (next == heap_end) {
-    morecore(asize - blocksize);
-    bt_make(block, asize, USED | bt_get_prevfree(block));
+  if (next == heap_end && morecore(asize - blocksize) != NULL) {
+    bt_make(block, asize, USED | GROWN | bt_get_prevfree(block));
+    stat_add(STAT_BYTES, (int64_t)asize - blocksize);
     return old_ptr;
   }
 
+  /* We are growing, so only the old payload may be copied: reading the
+   * requested size out of the old block runs past it, and under the
+   * preload build past the end of the mapping for a block near the top. */
+  size_t copy = blocksize - sizeof(word_t);
+  if (copy > size)
+    copy = size;
+
   /* jezeli bloki z obu stron sa wolne*/
   if (bt_get_prevfree(block) && bt_free(next)) {
     if (DEBUG_REALLOC)
@@ -401,15 +1562,16 @@ void *realloc(void *old_ptr, size_t size) {
     if (withboth >= asize) {
       list_remove(next);
       list_remove(prev);
-      memcpy(bt_payload(prev), old_ptr, size);
-      if (withboth - asize >= 16) { // 2 * ALIGNMENT
-        bt_make(prev, asize, USED);
+      memcpy(bt_payload(prev), old_ptr, copy);
+      if (withboth - asize >= MIN_BLOCK) {
+        bt_make(prev, asize, USED | GROWN);
         word_t *freeblock = bt_next(prev);
         bt_make(freeblock, withboth - asize, FREE);
         coalesce(freeblock);
       } else {
-        bt_make(prev, withboth, USED);
+        bt_make(prev, withboth, USED | GROWN);
       }
+      stat_add(STAT_BYTES, (int64_t)bt_size(prev) - blocksize);
       return bt_payload(prev);
     }
   }
@@ -422,15 +1584,18 @@ void *realloc(void *old_ptr, size_t size) {
     word_t withprev = blocksize + bt_size(prev);
     if (withprev >= asize) {
       list_remove(prev);
-      memcpy(bt_payload(prev), old_ptr, size);
-      if (withprev - asize >= 16) {
-        bt_make(prev, asize, USED | bt_get_prevfree(block));
+      memcpy(bt_payload(prev), old_ptr, copy);
+      if (withprev - asize >= MIN_BLOCK) {
+        /* prev was free, so the block before it is allocated and the merged
+         * block must not carry a PREVFREE bit. */
+        bt_make(prev, asize, USED | GROWN);
         word_t *prevnext = bt_next(prev);
         bt_make(prevnext, withprev - asize, FREE);
         coalesce(prevnext);
       } else {
-        bt_make(prev, withprev, USED | bt_get_prevfree(block));
+        bt_make(prev, withprev, USED | GROWN);
       }
+      stat_add(STAT_BYTES, (int64_t)bt_size(prev) - blocksize);
       return bt_payload(prev);
     }
   }
@@ -442,47 +1607,503 @@ void *realloc(void *old_ptr, size_t size) {
     word_t withnext = blocksize + bt_size(next);
     if (withnext >= asize) {
       list_remove(next);
-      if (withnext - asize >= 16) {
-        bt_make(block, asize, USED | bt_get_prevfree(block));
+      if (withnext - asize >= MIN_BLOCK) {
+        bt_make(block, asize, USED | GROWN | bt_get_prevfree(block));
         word_t *new = bt_next(block);
         bt_make(new, withnext - asize, FREE);
         coalesce(new);
       } else {
-        bt_make(block, withnext, USED | bt_get_prevfree(block));
+        bt_make(block, withnext, USED | GROWN | bt_get_prevfree(block));
       }
       /* Remove block we used from free list */
+      stat_add(STAT_BYTES, (int64_t)bt_size(block) - blocksize);
       return old_ptr;
     }
   }
 
-  /* ogolny przypadek */
-  word_t *new_ptr = malloc(size);
-  memcpy(new_ptr, old_ptr, size);
-  free(old_ptr);
+  /* ogolny przypadek. A block that realloc already grew once gets a
+   * geometric reserve on top, so an append loop that keeps landing here
+   * copies O(N) bytes overall instead of O(N^2); if the reserve does not
+   * fit we retry with the exact size. */
+  size_t want = size;
+  if (bt_get_grown(block))
+    want = size + size / 2;
+  word_t *new_ptr = malloc_internal(want);
+  if (!new_ptr && want != size)
+    new_ptr = malloc_internal(size);
+  if (!new_ptr)
+    return NULL;
+  bulk_copy(new_ptr, old_ptr, copy);
+  free_internal(old_ptr);
+  *bt_fromptr(new_ptr) |= GROWN;
   if (DEBUG_REALLOC)
     msg("realloc");
   return new_ptr;
 }
 
+static void *realloc_entry(void *old_ptr, size_t size) {
+  if (old_ptr == NULL)
+    return malloc_entry(size);
+  if (size == 0) {
+    free_entry(old_ptr);
+    return NULL;
+  }
+#ifdef STANDALONE
+  /* We cannot learn the size of a block somebody else allocated, so copy
+   * the requested amount and hope reallocs before the preload are rare. */
+  if (!mem_owns(old_ptr)) {
+    void *new_ptr = malloc_entry(size);
+    if (new_ptr != NULL)
+      bulk_copy(new_ptr, old_ptr, size);
+    return new_ptr;
+  }
+#endif
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_REALLOC], 1, __ATOMIC_RELAXED);
+  /* Resize within the owning arena, so even the copying fallback stays
+   * under a single arena lock. */
+  arena_t *arena = arena_of(old_ptr);
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  void *new_ptr = realloc_internal(old_ptr, size);
+  pthread_mutex_unlock(&arena->lock);
+  return new_ptr;
+#else
+  stat_add(STAT_REALLOC, 1);
+#if MM_SLAB
+  if (slab_owns(old_ptr))
+    return slab_realloc(old_ptr, size);
+#endif
+  return realloc_internal(old_ptr, size);
+#endif
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  void *new_ptr = realloc_entry(old_ptr, size);
+  trace_hook(TR_REALLOC, size, new_ptr);
+  return new_ptr;
+}
+
 /* --=[ calloc ]=----------------------------------------------------------- */
 
 void *calloc(size_t nmemb, size_t size) {
-  size_t bytes = nmemb * size;
+  size_t bytes;
+  if (__builtin_mul_overflow(nmemb, size, &bytes))
+    return NULL;
+#ifndef THREADED
+  /* A block whose payload lies entirely above the all-time heap high-water
+   * mark came straight out of morecore and was never written (the allocator
+   * only touches boundary tags around it), so it is still mmap zeroes. */
+  word_t *mark = virgin;
+  void *new_ptr = malloc(bytes);
+  if (new_ptr && (word_t *)new_ptr > mark)
+    return new_ptr;
+#else
   void *new_ptr = malloc(bytes);
+#endif
   if (new_ptr)
-    memset(new_ptr, 0, bytes);
+    bulk_zero(new_ptr, bytes);
   return new_ptr;
 }
 
+/* --=[ aligned_alloc ]=---------------------------------------------------- */
+
+/* Serves a payload aligned to more than ALIGNMENT: finds room for an
+ * aligned block (a fit of asize + alignment - ALIGNMENT bytes holds one
+ * wherever the alignment boundary falls) and gives the misaligned
+ * prefix and the tail past the block straight back to the free lists. */
+static void *memalign_internal(size_t alignment, size_t size) {
+  size_t asize = blksz(size);
+  word_t *fit = find_fit(asize + alignment - ALIGNMENT);
+#if DEFERRED_COALESCE
+  if (!fit && quarcount > 0) {
+    quarantine_flush();
+    fit = find_fit(asize + alignment - ALIGNMENT);
+  }
+#endif
+  word_t *block;
+  if (fit) {
+    list_remove(fit);
+    size_t blksize = bt_size(fit);
+    uintptr_t payload =
+      ((uintptr_t)bt_payload(fit) + alignment - 1) & -(uintptr_t)alignment;
+    /* Both ends of the carve keep the 16-byte block grid: the payload is
+     * alignment-aligned, so the prefix and suffix are multiples of 16. */
+    size_t prefix = payload - sizeof(word_t) - (uintptr_t)fit;
+    size_t suffix = blksize - prefix - asize;
+    word_t prevfree = bt_get_prevfree(fit);
+    block = (word_t *)(payload - sizeof(word_t));
+    bt_make(block, asize, USED | (prefix ? PREVFREE : prevfree));
+    if (prefix) {
+      /* The fit was free, so its left neighbor is not: just relink. */
+      bt_make(fit, prefix, FREE | prevfree);
+      list_add(fit);
+    }
+    if (suffix) {
+      word_t *rest = bt_next(block);
+      bt_make(rest, suffix, FREE);
+      coalesce(rest);
+    }
+  } else {
+    uintptr_t payload = ((uintptr_t)heap_end + sizeof(word_t) + alignment - 1) &
+                        -(uintptr_t)alignment;
+    size_t gap = payload - sizeof(word_t) - (uintptr_t)heap_end;
+    word_t *base = morecore(gap + asize);
+    if (!base)
+      return NULL;
+    /* Like malloc's extension path, the old epilogue still sits at base
+     * and carries the PREVFREE bit of the old last block. */
+    word_t prevfree = bt_get_prevfree(base);
+    block = (word_t *)(payload - sizeof(word_t));
+    bt_make(block, asize, USED | (gap ? PREVFREE : prevfree));
+    if (gap) {
+      bt_make(base, gap, FREE | prevfree);
+      coalesce(base);
+    }
+  }
+  stat_add(STAT_BYTES, bt_size(block));
+  return bt_payload(block);
+}
+
+static void *aligned_alloc_entry(size_t alignment, size_t size) {
+#ifdef STANDALONE
+  mm_standalone_init();
+#endif
+  if (alignment == 0 || (alignment & (alignment - 1)) || alignment > MAX_HEAP)
+    return NULL;
+  /* The block grid guarantees small alignments for free. */
+  if (alignment <= ALIGNMENT)
+    return malloc_entry(size);
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_MALLOC], 1, __ATOMIC_RELAXED);
+  arena_t *arena = arena_self();
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  arena_drain_remote(arena);
+  void *ptr = memalign_internal(alignment, size);
+  pthread_mutex_unlock(&arena->lock);
+  if (ptr)
+    return ptr;
+  /* Home arena's slice is exhausted: borrow from the other arenas. */
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    arena = &arenas[i];
+    if (arena == home)
+      continue;
+    pthread_mutex_lock(&arena->lock);
+    cur = arena;
+    arena_drain_remote(arena);
+    ptr = memalign_internal(alignment, size);
+    pthread_mutex_unlock(&arena->lock);
+    if (ptr)
+      return ptr;
+  }
+  return NULL;
+#else
+  stat_add(STAT_MALLOC, 1);
+  return memalign_internal(alignment, size);
+#endif
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr = aligned_alloc_entry(alignment, size);
+  trace_hook(TR_MEMALIGN, size, ptr);
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || alignment == 0 ||
+      (alignment & (alignment - 1)))
+    return EINVAL;
+  void *ptr = aligned_alloc(alignment, size);
+  if (ptr == NULL)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/* --=[ batch malloc/free ]=------------------------------------------------ */
+
+/* Carves same-size blocks out of single large fits (or one heap
+ * extension), so a run of N allocations pays for one find_fit and one
+ * split instead of N. Returns how many blocks it produced. */
+static size_t malloc_batch_internal(size_t size, size_t n, void **out) {
+  size_t asize = blksz(size);
+  size_t produced = 0;
+  while (produced < n) {
+    size_t want = (n - produced) * asize;
+    word_t *ptr = find_fit(want);
+#if DEFERRED_COALESCE
+    if (!ptr && quarcount > 0) {
+      quarantine_flush();
+      ptr = find_fit(want);
+    }
+#endif
+    size_t blksize;
+    if (ptr) {
+      list_remove(ptr);
+      blksize = bt_size(ptr);
+    } else {
+      ptr = morecore(want);
+      if (!ptr)
+        break;
+      blksize = want;
+    }
+    /* Lay the blocks down back to back; only the first can have a free
+     * left neighbor, and bt_make keeps the PREVFREE chain right as it
+     * walks. */
+    word_t prevfree = bt_get_prevfree(ptr);
+    size_t count = blksize / asize;
+    if (count > n - produced)
+      count = n - produced;
+    for (size_t i = 0; i < count; i++) {
+      bt_make(ptr, asize, USED | (i == 0 ? prevfree : 0));
+      out[produced++] = bt_payload(ptr);
+      ptr = (void *)ptr + asize;
+    }
+    if (blksize > count * asize) {
+      bt_make(ptr, blksize - count * asize, FREE);
+      coalesce(ptr);
+    }
+    stat_add(STAT_BYTES, count * asize);
+  }
+  /* Out of contiguous room: serve stragglers one by one. */
+  while (produced < n) {
+    void *ptr = malloc_internal(size);
+    if (!ptr)
+      break;
+    out[produced++] = ptr;
+  }
+  return produced;
+}
+
+/* Gives a sorted slice of blocks back: adjacent blocks in the array
+ * become one free range with a single bt_make and coalesce, instead of
+ * percolating through coalesce() block by block. */
+static void free_batch_internal(void **ptrs, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+#if MM_SLAB
+    if (slab_owns(ptrs[i])) {
+      slab_free(ptrs[i]);
+      i++;
+      continue;
+    }
+#endif
+    word_t *first = bt_fromptr(ptrs[i]);
+    size_t run = bt_size(first);
+    size_t j = i + 1;
+    while (j < n && (void *)first + run == bt_fromptr(ptrs[j])) {
+#if MM_SLAB
+      if (slab_owns(ptrs[j]))
+        break;
+#endif
+      run += bt_size(bt_fromptr(ptrs[j]));
+      j++;
+    }
+    stat_add(STAT_BYTES, -(uint64_t)run);
+    bt_make(first, run, FREE | bt_get_prevfree(first));
+    coalesce(first);
+    i = j;
+  }
+}
+
+/* Allocates n blocks of the given size into out, returning how many it
+ * could produce (all n unless the heap is exhausted). */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+#ifdef STANDALONE
+  mm_standalone_init();
+#endif
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_MALLOC], n, __ATOMIC_RELAXED);
+  arena_t *arena = arena_self();
+  pthread_mutex_lock(&arena->lock);
+  cur = arena;
+  arena_drain_remote(arena);
+  size_t produced = malloc_batch_internal(size, n, out);
+  pthread_mutex_unlock(&arena->lock);
+  /* Home arena's slice is exhausted: borrow from the other arenas. */
+  for (int i = 0; produced < n && i < NUM_ARENAS; i++) {
+    arena = &arenas[i];
+    if (arena == home)
+      continue;
+    pthread_mutex_lock(&arena->lock);
+    cur = arena;
+    arena_drain_remote(arena);
+    produced += malloc_batch_internal(size, n - produced, out + produced);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return produced;
+#else
+  stat_add(STAT_MALLOC, n);
+  return malloc_batch_internal(size, n, out);
+#endif
+}
+
+static int ptr_cmp(const void *a, const void *b) {
+  uintptr_t pa = (uintptr_t)*(void *const *)a;
+  uintptr_t pb = (uintptr_t)*(void *const *)b;
+  return pa < pb ? -1 : pa > pb;
+}
+
+/* Frees n blocks at once. Sorts ptrs by address as a side effect, which
+ * is what lets adjacent blocks merge in one sweep. */
+void mm_free_batch(void **ptrs, size_t n) {
+  qsort(ptrs, n, sizeof(void *), ptr_cmp);
+  size_t i = 0;
+  while (i < n && ptrs[i] == NULL) /* NULLs sort to the front */
+    i++;
+#ifdef THREADED
+  __atomic_fetch_add(&arena_self()->statv[STAT_FREE], n, __ATOMIC_RELAXED);
+  /* The sort also groups the blocks by owning arena: one lock per run,
+   * even for blocks another thread allocated. */
+  while (i < n) {
+    arena_t *arena = arena_of(ptrs[i]);
+    size_t j = i + 1;
+    while (j < n && arena_of(ptrs[j]) == arena)
+      j++;
+    pthread_mutex_lock(&arena->lock);
+    cur = arena;
+    free_batch_internal(ptrs + i, j - i);
+    pthread_mutex_unlock(&arena->lock);
+    i = j;
+  }
+#else
+  stat_add(STAT_FREE, n);
+  free_batch_internal(ptrs + i, n - i);
+#endif
+}
+
+/* --=[ mm_trim ]=---------------------------------------------------------- */
+
+/* Shrinks one heap: releases the tail of a trailing free block back to
+ * the system through a negative sbrk, keeping at most pad bytes of it as
+ * slack for the next spike. Returns the number of bytes given back. */
+static size_t trim_arena(size_t pad) {
+#if DEFERRED_COALESCE
+  /* Quarantined blocks still look used; merge them first so a freed
+   * spike actually reaches the heap top. */
+  quarantine_flush();
+#endif
+  /* The epilogue's PREVFREE bit tells whether the last block is free. */
+  if (!bt_get_prevfree(heap_end))
+    return 0;
+  word_t *block = (void *)heap_end - bt_size(heap_end - 1);
+  size_t keep = (pad + ALIGNMENT - 1) & -(size_t)ALIGNMENT;
+  size_t size = bt_size(block);
+  if (size <= keep)
+    return 0;
+  size_t excess = size - keep;
+
+  list_remove(block);
+  if (keep == 0) {
+    word_t epilogue = USED | bt_get_prevfree(block);
+    heap_end = block;
+    *heap_end = epilogue;
+  } else {
+    word_t prevfree = bt_get_prevfree(block);
+    heap_end = (void *)block + keep;
+    *heap_end = USED;
+    bt_make(block, keep, FREE | prevfree);
+    list_add(block);
+  }
+
+#ifdef THREADED
+  /* The arena's slice is carved up front, so move the cursor back and
+   * give the pages back directly. */
+  heap_sbrk(-(long)excess);
+  mem_decommit(cur->brk, excess);
+#else
+  mem_sbrk(-(long)excess); /* decommits the released range itself */
+#endif
+  return excess;
+}
+
+/* Gives trailing free memory (beyond pad bytes of slack) back to the
+ * system, for jobs that free a large scratch spike and then hold their
+ * peak RSS for hours. */
+size_t mm_trim(size_t pad) {
+#ifdef THREADED
+  size_t released = 0;
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    cur = &arenas[i];
+    arena_drain_remote(&arenas[i]);
+    released += trim_arena(pad);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  return released;
+#else
+  return trim_arena(pad);
+#endif
+}
+
+/* --=[ mm_stats ]=--------------------------------------------------------- */
+
+/* Counts the treap's free blocks into the per-class snapshot. */
+static void tree_count(word_t *node, uint64_t *counts) {
+  if (node == ptr_address(0))
+    return;
+  counts[list_class(bt_size(node))]++;
+  tree_count(tree_left(node), counts);
+  tree_count(tree_right(node), counts);
+}
+
+/* Adds the current heap's counters and free-list snapshot into out. */
+static void stats_collect(struct mm_stats_out *out) {
+  out->malloc_calls += stats[STAT_MALLOC];
+  out->free_calls += stats[STAT_FREE];
+  out->realloc_calls += stats[STAT_REALLOC];
+  out->bytes_in_use += stats[STAT_BYTES];
+  out->coalesce_merges += stats[STAT_MERGES];
+  for (int i = 0; i < MM_FIT_HIST; i++)
+    out->fit_scan_hist[i] += stats[STAT_HIST + i];
+  for (int class = 0; class < NUM_CLASSES; class++)
+    for (word_t *ptr = ptr_address(buckets[class]); ptr != ptr_address(0);
+         ptr = ptr_next(ptr))
+      out->free_blocks[class]++;
+  tree_count(tree_root, out->free_blocks);
+}
+
+/* Fills out with the counters bumped on the hot paths plus a snapshot of
+ * the free lists. Cheap enough to call live: the snapshot walks only free
+ * blocks, never the whole heap. */
+void mm_stats(struct mm_stats_out *out) {
+  memset(out, 0, sizeof(*out));
+#ifdef THREADED
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    cur = &arenas[i];
+    stats_collect(out);
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+#else
+  stats_collect(out);
+#endif
+}
+
 /* --=[ mm_checkheap ]=----------------------------------------------------- */
 
-void mm_checkheap(int verbose) {
+static void checkheap_arena(void) {
   void *bt;
-  msg("Check Heap \n");
   for (bt = heap_start; bt && bt_size(bt) > 0; bt = bt_next(bt)) {
     getblockinfo(bt);
   }
-  msg("Heap start: %p Heap end: %p List start: %p List end: %p \n", heap_start,
-      heap_end, list_start, list_end);
+  msg("Heap start: %p Heap end: %p \n", heap_start, heap_end);
+  for (int class = 0; class < NUM_CLASSES; class++)
+    if (buckets[class] != 0)
+      msg("Class %d starts at: %p \n", class, ptr_address(buckets[class]));
+}
+
+void mm_checkheap(int verbose) {
+  msg("Check Heap \n");
+#ifdef THREADED
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    cur = &arenas[i];
+    msg("Arena %d \n", i);
+    checkheap_arena();
+  }
+#else
+  checkheap_arena();
+#endif
   msg("Check Heap End\n\n");
 }
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 
 #ifdef DRIVER
@@ -7,6 +8,8 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
 
 #else
 
@@ -15,6 +18,8 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
 
 #endif
 
@@ -23,3 +28,39 @@ extern int mm_init(void);
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+/* Statistics counters kept by the allocator (see mm_stats). */
+#define MM_FIT_HIST 8     /* find_fit scan length, log2 buckets: 0, 1,
+                             2-3, 4-7, ..., >=64 blocks examined */
+#define MM_NUM_CLASSES 24 /* size classes, class i holds [16<<i, 16<<(i+1)) */
+
+struct mm_stats_out {
+  uint64_t malloc_calls;
+  uint64_t free_calls;
+  uint64_t realloc_calls;
+  uint64_t bytes_in_use;    /* block bytes currently handed out */
+  uint64_t coalesce_merges; /* neighbor merges performed by coalesce */
+  uint64_t fit_scan_hist[MM_FIT_HIST];
+  uint64_t free_blocks[MM_NUM_CLASSES]; /* snapshot of the free lists */
+};
+
+extern void mm_stats(struct mm_stats_out *out);
+
+/* Batched entry points for tight same-size allocation loops: the batch
+ * malloc carves n blocks out of single large fits and returns how many
+ * it produced; the batch free merges adjacent blocks in one sweep (and
+ * sorts ptrs by address as a side effect). */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Releases trailing free memory (keeping up to pad bytes of slack) back
+ * to the system; returns the number of bytes given back. */
+extern size_t mm_trim(size_t pad);
+
+/* Event tracing (see the event ring in mm.c): mm_trace_start arms a
+ * ring of the given number of records (rounded up to a power of two)
+ * that every entry point then appends to with a few stores;
+ * mm_trace_dump writes the captured tail to fd as text using only
+ * async-signal-safe calls, so it may run from a signal handler. */
+extern int mm_trace_start(size_t records);
+extern void mm_trace_dump(int fd);
@@ -0,0 +1,386 @@
+/*
+ * mmgen.c - synthetic trace generator. The bundled traces are fixed
+ * CS:APP workloads; this tool emits .rep traces shaped like a server
+ * instead: a set of long-lived base allocations made up front, sizes
+ * drawn from an exponential distribution, a live-set target the
+ * generator steers towards, and bursty phases that alternate between
+ * allocation-heavy and free-heavy. Every trace is fully determined by
+ * its seed. Text output replays directly with mdriver -f; pipe it
+ * through mdriver -f trace -c out.repb if you want the binary form.
+ *
+ * The -F mode is a correctness fuzzer: it generates N traces with
+ * derived seeds, runs each one through the driver (whose default pass
+ * is eval_mm_valid), and on the first failure keeps the offending
+ * trace on disk and reports its seed so the case can be replayed.
+ *
+ * Options:
+ *   -n <ops>    approximate number of operations (default 100000)
+ *   -s <seed>   random seed (default 1)
+ *   -l <bytes>  live-set target the generator steers towards (default 1M)
+ *   -m <bytes>  mean of the exponential size distribution (default 128)
+ *   -x <bytes>  size cap (default 65536)
+ *   -p <count>  long-lived base allocations made up front (default 64)
+ *   -u <ops>    average phase length between alloc/free bursts (default 256)
+ *   -r <pct>    percentage of operations that are reallocs (default 5)
+ *   -e          also emit aligned (m) and batch (b/d) operations
+ *   -o <file>   output file (default stdout)
+ *   -F <count>  fuzz: generate <count> traces and replay each with -d
+ *   -d <driver> driver binary for -F (default ./mdriver)
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Every object the generator keeps live: a single block, or a run of
+ * count consecutive indices that came from one batch allocation and
+ * will leave through one batch free. */
+typedef struct {
+  int index;
+  int count;   /* 1 for singles, n for batch runs */
+  int base;    /* long-lived: not a victim until the final drain */
+  size_t size; /* total payload bytes, for live-set accounting */
+} object_t;
+
+typedef struct {
+  char type;
+  int index;
+  size_t size;
+  size_t align; /* alignment for 'm', count for 'b'/'d' */
+} genop_t;
+
+typedef struct {
+  size_t nops;
+  uint64_t seed;
+  size_t live_target;
+  size_t mean_size;
+  size_t max_size;
+  int base_count;
+  int burst;
+  int realloc_pct;
+  int exotic;
+} params_t;
+
+static void die(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(EXIT_FAILURE);
+}
+
+/* --=[ deterministic randomness ]=------------------------------------------ */
+
+/* xorshift64*: traces must replay identically everywhere, so we do not
+ * rely on the platform's rand(). */
+static uint64_t rngstate;
+
+static uint64_t rng64(void) {
+  uint64_t x = rngstate;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  rngstate = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int chance(int pct) {
+  return (int)(rng64() % 100) < pct;
+}
+
+static size_t draw_size(const params_t *p) {
+  /* Exponential with the requested mean, capped, never zero. */
+  double u = (double)(rng64() >> 11) * 0x1p-53;
+  size_t size = 1 + (size_t)(-(double)p->mean_size * log(1.0 - u));
+  return size > p->max_size ? p->max_size : size;
+}
+
+/* --=[ trace synthesis ]=--------------------------------------------------- */
+
+static genop_t *ops;
+static size_t nops, maxops;
+
+static void emit(char type, int index, size_t size, size_t align) {
+  if (nops == maxops) {
+    maxops = maxops ? 2 * maxops : 4096;
+    ops = realloc(ops, maxops * sizeof(genop_t));
+    if (!ops)
+      die("mmgen: out of memory");
+  }
+  ops[nops++] = (genop_t){type, index, size, align};
+}
+
+static object_t *live;
+static int nlive, maxlive;
+
+static void live_add(object_t obj) {
+  if (nlive == maxlive) {
+    maxlive = maxlive ? 2 * maxlive : 1024;
+    live = realloc(live, maxlive * sizeof(object_t));
+    if (!live)
+      die("mmgen: out of memory");
+  }
+  live[nlive++] = obj;
+}
+
+/* Index allocation: singles recycle freed indices through a stack (the
+ * bundled traces reuse indices the same way), batch runs always take
+ * fresh consecutive indices from the high-water mark. */
+static int *freeids;
+static int nfreeids, maxfreeids, next_index;
+
+static int index_get(void) {
+  if (nfreeids > 0)
+    return freeids[--nfreeids];
+  return next_index++;
+}
+
+static void index_put(int index) {
+  if (nfreeids == maxfreeids) {
+    maxfreeids = maxfreeids ? 2 * maxfreeids : 1024;
+    freeids = realloc(freeids, maxfreeids * sizeof(int));
+    if (!freeids)
+      die("mmgen: out of memory");
+  }
+  freeids[nfreeids++] = index;
+}
+
+/* Frees the object at position i in the live array (swap-remove). */
+static size_t drop_object(int i) {
+  object_t obj = live[i];
+  live[i] = live[--nlive];
+  if (obj.count > 1) {
+    emit('d', obj.index, 0, obj.count);
+  } else {
+    emit('f', obj.index, 0, 0);
+    index_put(obj.index);
+  }
+  return obj.size;
+}
+
+static void generate(const params_t *p, FILE *out) {
+  rngstate = p->seed ? p->seed : 1;
+  nops = nlive = nfreeids = next_index = 0;
+
+  /* Long-lived base allocations: carved up front, freed only in the
+   * final drain, so everything else churns above them. */
+  for (int i = 0; i < p->base_count; i++) {
+    size_t size = draw_size(p);
+    int index = index_get();
+    emit('a', index, size, 0);
+    live_add((object_t){index, 1, 1, size});
+  }
+
+  size_t live_bytes = 0;
+  int freephase = 0;
+  while (nops < p->nops) {
+    if (p->burst > 0 && rng64() % p->burst == 0)
+      freephase = !freephase;
+
+    /* Steer towards the live-set target: allocation-heavy unless a free
+     * burst is on or the target is exceeded. */
+    int alloc_pct = freephase ? 15 : 85;
+    if (live_bytes > p->live_target)
+      alloc_pct /= 3;
+
+    if (nlive > p->base_count && chance(p->realloc_pct)) {
+      int i = (int)(rng64() % nlive);
+      if (live[i].count == 1 && !live[i].base) {
+        size_t size = draw_size(p);
+        emit('r', live[i].index, size, 0);
+        live_bytes += size - live[i].size;
+        live[i].size = size;
+        continue;
+      }
+    }
+
+    if (nlive == p->base_count || chance(alloc_pct)) {
+      if (p->exotic && chance(10)) {
+        size_t align = (size_t)32 << rng64() % 8; /* 32 .. 4096 */
+        size_t size = draw_size(p);
+        int index = index_get();
+        emit('m', index, size, align);
+        live_add((object_t){index, 1, 0, size});
+        live_bytes += size;
+      } else if (p->exotic && chance(10)) {
+        int count = 2 + (int)(rng64() % 31);
+        size_t size = draw_size(p);
+        emit('b', next_index, size, count);
+        live_add((object_t){next_index, count, 0, count * size});
+        next_index += count;
+        live_bytes += count * size;
+      } else {
+        size_t size = draw_size(p);
+        int index = index_get();
+        emit('a', index, size, 0);
+        live_add((object_t){index, 1, 0, size});
+        live_bytes += size;
+      }
+    } else {
+      int i = (int)(rng64() % nlive);
+      if (!live[i].base)
+        live_bytes -= drop_object(i);
+    }
+  }
+
+  /* Drain: free everything (base allocations included) so the trace is
+   * balanced and utilization is comparable across runs. */
+  while (nlive > 0)
+    drop_object(nlive - 1);
+
+  fprintf(out, "1\n%d\n%zu\n0\n", next_index, nops);
+  for (size_t i = 0; i < nops; i++) {
+    genop_t *op = &ops[i];
+    switch (op->type) {
+    case 'a':
+      fprintf(out, "a %d %zu\n", op->index, op->size);
+      break;
+    case 'f':
+      fprintf(out, "f %d\n", op->index);
+      break;
+    case 'r':
+      fprintf(out, "r %d %zu\n", op->index, op->size);
+      break;
+    case 'm':
+      fprintf(out, "m %d %zu %zu\n", op->index, op->align, op->size);
+      break;
+    case 'b':
+      fprintf(out, "b %d %zu %zu\n", op->index, op->align, op->size);
+      break;
+    case 'd':
+      fprintf(out, "d %d %zu\n", op->index, op->align);
+      break;
+    }
+  }
+}
+
+/* --=[ fuzzing ]=----------------------------------------------------------- */
+
+/* One fuzz iteration: write the trace, replay it with the driver (whose
+ * default run is the validity pass), report pass/fail by exit status. */
+static int replay(const char *driver, const char *tracefile) {
+  pid_t pid = fork();
+  if (pid < 0)
+    die("mmgen: fork failed");
+  if (pid == 0) {
+    execlp(driver, driver, "-f", tracefile, "-v", "0", (char *)NULL);
+    die("mmgen: cannot exec %s", driver);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0)
+    die("mmgen: waitpid failed");
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int fuzz(const params_t *p, int count, const char *driver) {
+  for (int i = 0; i < count; i++) {
+    params_t it = *p;
+    it.seed = p->seed + (uint64_t)i;
+    char tracefile[64];
+    snprintf(tracefile, sizeof(tracefile), "/tmp/mmgen-%d.rep", getpid());
+    FILE *out = fopen(tracefile, "w");
+    if (!out)
+      die("mmgen: cannot write %s", tracefile);
+    generate(&it, out);
+    fclose(out);
+    if (!replay(driver, tracefile)) {
+      fprintf(stderr, "mmgen: FAILED seed %llu, trace kept at %s\n",
+              (unsigned long long)it.seed, tracefile);
+      return EXIT_FAILURE;
+    }
+    printf("mmgen: seed %llu ok\n", (unsigned long long)it.seed);
+    unlink(tracefile);
+  }
+  printf("mmgen: %d traces passed\n", count);
+  return EXIT_SUCCESS;
+}
+
+/* --=[ main ]=-------------------------------------------------------------- */
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: mmgen [-n ops] [-s seed] [-l live] [-m mean] [-x max]\n"
+          "             [-p base] [-u burst] [-r pct] [-e] [-o file]\n"
+          "             [-F count [-d driver]]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  params_t p = {
+    .nops = 100000,
+    .seed = 1,
+    .live_target = 1 << 20,
+    .mean_size = 128,
+    .max_size = 65536,
+    .base_count = 64,
+    .burst = 256,
+    .realloc_pct = 5,
+    .exotic = 0,
+  };
+  const char *outfile = NULL;
+  const char *driver = "./mdriver";
+  int fuzz_count = 0;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:s:l:m:x:p:u:r:eo:F:d:")) != -1) {
+    switch (c) {
+    case 'n':
+      p.nops = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      p.seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'l':
+      p.live_target = strtoul(optarg, NULL, 0);
+      break;
+    case 'm':
+      p.mean_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'x':
+      p.max_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      p.base_count = atoi(optarg);
+      break;
+    case 'u':
+      p.burst = atoi(optarg);
+      break;
+    case 'r':
+      p.realloc_pct = atoi(optarg);
+      break;
+    case 'e':
+      p.exotic = 1;
+      break;
+    case 'o':
+      outfile = optarg;
+      break;
+    case 'F':
+      fuzz_count = atoi(optarg);
+      break;
+    case 'd':
+      driver = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (p.mean_size == 0 || p.max_size == 0 || p.base_count < 0)
+    usage();
+
+  if (fuzz_count > 0)
+    return fuzz(&p, fuzz_count, driver);
+
+  FILE *out = stdout;
+  if (outfile && !(out = fopen(outfile, "w")))
+    die("mmgen: cannot write %s", outfile);
+  generate(&p, out);
+  if (out != stdout)
+    fclose(out);
+  return EXIT_SUCCESS;
+}
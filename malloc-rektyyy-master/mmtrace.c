@@ -0,0 +1,386 @@
+/*
+ * mmtrace.c - LD_PRELOAD capture shim: records the malloc/free/realloc/
+ * calloc/aligned_alloc calls of a live process into a compiled binary
+ * trace that mdriver replays (see repb_header_t in mdriver.c; the
+ * record layouts here must stay in sync).
+ *
+ * Usage: MMTRACE_OUT=app.repb LD_PRELOAD=./mmtrace.so ./app
+ *
+ * Every application thread pushes fixed-size events into its own
+ * single-producer/single-consumer ring buffer, so the hot path is two
+ * atomic loads, a store and no locks. A background writer thread drains
+ * the rings, maps live pointers to dense trace indices (reusing the
+ * index of a freed block, the way the bundled traces do) and streams
+ * traceop_t records to the output file. The header is patched on exit
+ * once the final op and index counts are known.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* ---- the binary trace format, kept in sync with mdriver.c ---- */
+
+#define REPB_MAGIC 0x42504552 /* "REPB", little-endian */
+#define REPB_VERSION 2
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t weight;
+  int32_t num_ids;
+  int32_t num_ops;
+  int32_t ignore_ranges;
+} repb_header_t;
+
+enum { ALLOC, FREE, REALLOC, MEMALIGN };
+
+typedef struct {
+  int32_t type;
+  int32_t index;
+  uint64_t size;
+  uint64_t align; /* "m" ops only, else 0 */
+} traceop_t;
+
+/* ---- per-thread event rings ---- */
+
+#define RING_SIZE (1 << 14) /* events per thread, power of two */
+
+typedef struct {
+  uint8_t op;
+  void *ptr; /* result pointer (or the freed pointer) */
+  void *old; /* old pointer for realloc */
+  size_t size;
+  size_t align; /* alignment request, 0 for the plain entry points */
+} event_t;
+
+typedef struct ring {
+  event_t ev[RING_SIZE];
+  volatile uint32_t head; /* written by the owning thread */
+  volatile uint32_t tail; /* written by the writer thread */
+  struct ring *next;      /* global list, never removed */
+} ring_t;
+
+static ring_t *rings;             /* all rings, CAS-pushed */
+static __thread ring_t *myring;
+
+/* ---- real allocator entry points ---- */
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+
+/* dlsym itself callocs before the real functions are resolved; such
+ * early requests are served from this static arena and their frees are
+ * ignored. */
+static char boot_heap[1 << 16];
+static size_t boot_brk;
+
+static int capturing; /* set once the writer thread is up */
+
+static void *boot_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (boot_brk + size > sizeof(boot_heap))
+    return NULL;
+  void *ptr = boot_heap + boot_brk;
+  boot_brk += size;
+  return ptr;
+}
+
+static int boot_owns(void *ptr) {
+  return (char *)ptr >= boot_heap && (char *)ptr < boot_heap + sizeof(boot_heap);
+}
+
+/* ---- event production (application threads) ---- */
+
+static ring_t *ring_new(void) {
+  ring_t *r = real_malloc(sizeof(ring_t));
+  if (r == NULL)
+    return NULL;
+  memset(r, 0, sizeof(*r));
+  ring_t *head = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  do {
+    r->next = head;
+  } while (!__atomic_compare_exchange_n(&rings, &head, r, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+  myring = r;
+  return r;
+}
+
+static void push(uint8_t op, void *ptr, void *old, size_t size,
+                 size_t align) {
+  if (!capturing || ptr == NULL)
+    return;
+  ring_t *r = myring ? myring : ring_new();
+  if (r == NULL)
+    return;
+  uint32_t head = r->head;
+  /* Full means the writer is behind; wait rather than drop events. */
+  while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+    sched_yield();
+  r->ev[head % RING_SIZE] = (event_t){op, ptr, old, size, align};
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* ---- the writer thread ---- */
+
+/* Open-addressing map from live pointer to trace index. Only the writer
+ * thread touches it, so no locking. Tombstones count toward the load
+ * factor like live entries: probes stop only at NULL slots, so letting
+ * free churn eat the NULL slots would drive probe lengths toward nslots
+ * (and an absent-key lookup into an endless loop). Growing rehashes the
+ * live entries only, which turns the tombstones back into NULL slots. */
+static struct slot {
+  void *ptr; /* NULL empty, (void *)-1 tombstone */
+  int32_t index;
+} *slots;
+static size_t nslots = 1 << 12, nused, ntomb;
+
+#define FREEIDX_CAP (1 << 20)
+static int32_t *freeidx; /* stack of reusable indices */
+static int32_t nfree, next_index, max_ids;
+
+static int out_fd = -1;
+static int32_t num_ops;
+static volatile int done;
+static pthread_t writer;
+
+static size_t slot_of(void *ptr) {
+  size_t i = ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull % nslots;
+  size_t tomb = (size_t)-1;
+  while (slots[i].ptr != NULL) {
+    if (slots[i].ptr == ptr)
+      return i;
+    if (slots[i].ptr == (void *)-1 && tomb == (size_t)-1)
+      tomb = i;
+    i = (i + 1) % nslots;
+  }
+  return tomb != (size_t)-1 ? tomb : i;
+}
+
+static void map_grow(void) {
+  struct slot *old = slots;
+  size_t oldn = nslots;
+  nslots *= 2;
+  slots = real_calloc(nslots, sizeof(struct slot));
+  for (size_t i = 0; i < oldn; i++)
+    if (old[i].ptr != NULL && old[i].ptr != (void *)-1)
+      slots[slot_of(old[i].ptr)] = old[i];
+  ntomb = 0; /* the rehash dropped them */
+  real_free(old);
+}
+
+static int32_t map_insert(void *ptr) {
+  if ((++nused + ntomb) * 10 > nslots * 7)
+    map_grow();
+  int32_t index = nfree > 0 ? freeidx[--nfree] : next_index++;
+  if (next_index > max_ids)
+    max_ids = next_index;
+  size_t i = slot_of(ptr);
+  if (slots[i].ptr == (void *)-1)
+    ntomb--;
+  slots[i] = (struct slot){ptr, index};
+  return index;
+}
+
+/* Returns the index or -1 if the pointer was never seen (e.g. it came
+ * from the bootstrap arena or predates the capture). */
+static int32_t map_remove(void *ptr) {
+  size_t i = slot_of(ptr);
+  if (slots[i].ptr != ptr)
+    return -1;
+  int32_t index = slots[i].index;
+  slots[i].ptr = (void *)-1;
+  ntomb++;
+  nused--;
+  if (nfree < FREEIDX_CAP) /* beyond that the index is just retired */
+    freeidx[nfree++] = index;
+  return index;
+}
+
+/* Rebind a moved realloc pointer to its existing index. */
+static int32_t map_move(void *old_ptr, void *new_ptr) {
+  size_t i = slot_of(old_ptr);
+  if (slots[i].ptr != old_ptr)
+    return -1;
+  int32_t index = slots[i].index;
+  slots[i].ptr = (void *)-1;
+  ntomb++;
+  size_t j = slot_of(new_ptr);
+  if (slots[j].ptr == (void *)-1)
+    ntomb--;
+  slots[j] = (struct slot){new_ptr, index};
+  return index;
+}
+
+static void emit(int32_t type, int32_t index, uint64_t size,
+                 uint64_t align) {
+  traceop_t op = {type, index, size, align};
+  if (write(out_fd, &op, sizeof(op)) == sizeof(op))
+    num_ops++;
+}
+
+static void consume(event_t *ev) {
+  /* The driver asserts nonzero request sizes; round malloc(0) up. */
+  uint64_t size = ev->size ? ev->size : 1;
+  int32_t index;
+  switch (ev->op) {
+    case ALLOC:
+      emit(ALLOC, map_insert(ev->ptr), size, 0);
+      break;
+    case MEMALIGN:
+      emit(MEMALIGN, map_insert(ev->ptr), size, ev->align);
+      break;
+    case FREE:
+      if ((index = map_remove(ev->ptr)) >= 0)
+        emit(FREE, index, 0, 0);
+      break;
+    case REALLOC:
+      /* The trace format keeps the index across a realloc move. */
+      if ((index = map_move(ev->old, ev->ptr)) >= 0)
+        emit(REALLOC, index, size, 0);
+      else
+        emit(ALLOC, map_insert(ev->ptr), size, 0);
+      break;
+  }
+}
+
+static int drain(void) {
+  int drained = 0;
+  for (ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+       r = r->next) {
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (r->tail != head) {
+      consume(&r->ev[r->tail % RING_SIZE]);
+      __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+      drained++;
+    }
+  }
+  return drained;
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+  while (!done) {
+    if (drain() == 0)
+      usleep(1000);
+  }
+  drain();
+  return NULL;
+}
+
+/* ---- setup and teardown ---- */
+
+__attribute__((constructor)) static void mmtrace_init(void) {
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+
+  const char *out = getenv("MMTRACE_OUT");
+  if (out == NULL)
+    out = "mm.trace.repb";
+  out_fd = open(out, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (out_fd < 0)
+    return;
+
+  repb_header_t hdr = {REPB_MAGIC, REPB_VERSION, 1, 0, 0, 1};
+  if (write(out_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    return;
+
+  slots = real_calloc(nslots, sizeof(struct slot));
+  freeidx = real_malloc(FREEIDX_CAP * sizeof(int32_t));
+  if (slots == NULL || freeidx == NULL)
+    return;
+
+  if (pthread_create(&writer, NULL, writer_main, NULL) == 0)
+    capturing = 1;
+}
+
+__attribute__((destructor)) static void mmtrace_fini(void) {
+  if (!capturing)
+    return;
+  capturing = 0;
+  done = 1;
+  pthread_join(writer, NULL);
+
+  /* Patch the final counts into the header. */
+  repb_header_t hdr = {REPB_MAGIC, REPB_VERSION, 1,
+                       max_ids ? max_ids : 1, num_ops, 1};
+  pwrite(out_fd, &hdr, sizeof(hdr), 0);
+  close(out_fd);
+}
+
+/* ---- the interposed entry points ---- */
+
+void *malloc(size_t size) {
+  if (real_malloc == NULL)
+    return boot_alloc(size);
+  void *ptr = real_malloc(size);
+  push(ALLOC, ptr, NULL, size, 0);
+  return ptr;
+}
+
+void free(void *ptr) {
+  if (ptr == NULL || boot_owns(ptr))
+    return;
+  push(FREE, ptr, NULL, 0, 0);
+  real_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (real_calloc == NULL) {
+    void *ptr = boot_alloc(nmemb * size);
+    if (ptr != NULL)
+      memset(ptr, 0, nmemb * size);
+    return ptr;
+  }
+  void *ptr = real_calloc(nmemb, size);
+  push(ALLOC, ptr, NULL, nmemb * size, 0);
+  return ptr;
+}
+
+void *realloc(void *old_ptr, size_t size) {
+  if (real_realloc == NULL || boot_owns(old_ptr))
+    return NULL;
+  void *ptr = real_realloc(old_ptr, size);
+  if (old_ptr == NULL)
+    push(ALLOC, ptr, NULL, size, 0);
+  else if (size == 0)
+    push(FREE, old_ptr, NULL, 0, 0);
+  else
+    push(REALLOC, ptr, old_ptr, size, 0);
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (real_aligned_alloc == NULL)
+    return NULL;
+  void *ptr = real_aligned_alloc(alignment, size);
+  push(MEMALIGN, ptr, NULL, size, alignment);
+  return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (real_posix_memalign == NULL)
+    return ENOMEM;
+  int err = real_posix_memalign(memptr, alignment, size);
+  if (err == 0)
+    push(MEMALIGN, *memptr, NULL, size, alignment);
+  return err;
+}